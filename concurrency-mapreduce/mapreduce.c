@@ -2,42 +2,222 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mapreduce.h"
 
-// Key-Value 对结构
+// Key-Value 对结构（key/value 指向 arena 中的字符串，不单独 free）
 typedef struct {
     char *key;
     char *value;
 } KVPair;
 
+// 线性分配区（bump arena）：从大块内存中顺序切出 key/value 字符串，
+// MR_Run 结束时按块整体释放，没有每个字符串的 malloc 头和 free
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define INTERN_SLOTS 256       // 值驻留表大小（直接映射）
+#define INTERN_MAX_LEN 32      // 只驻留较短的值（如 "1"）
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;                 // 链表头是正在使用的块
+    size_t bytes;                       // 所有块的总大小
+    size_t used;                        // 已经切出去的字节数
+    size_t chunk_size;                  // 新块的大小，0 表示 ARENA_CHUNK_SIZE
+    char *interned[INTERN_SLOTS];       // 最近见过的值，相同的值共用一份
+} __attribute__((aligned(64))) Arena;
+
+// Reduce 阶段某个 key 的值区间：排序后它的值是 pairs[next..end)
+typedef struct {
+    char *key;              // 指向 pairs 中的 key
+    int next;               // 下一个要返回的值
+    int end;
+} ValueCursor;
+
+// 溢写到临时文件的一段有序记录（key\0value\0 ...）
+typedef struct {
+    int fd;
+    off_t offset;
+    off_t length;
+} SpillRun;
+
+// mapper 自己排好序的一段内存记录（presort 模式）
+typedef struct {
+    KVPair *pairs;
+    int count;
+} SortedRun;
+
 // 分区数据结构
 typedef struct {
     KVPair *pairs;          // KV 对数组
     int count;              // 当前数量
     int capacity;           // 容量
     pthread_mutex_t lock;   // 互斥锁
+    ValueCursor current;    // 正在 Reduce 的 key
+    ValueCursor *others;    // Reduce 函数顺带访问过的其他 key
+    int num_others;
+    int others_capacity;
+    SpillRun *runs;         // 溢写出去的部分
+    int num_runs;
+    int runs_capacity;
+    FILE *merge_file;       // run 太多时先归并成较大的 run，写到这里
+    off_t merge_offset;
+    SortedRun *sorted;      // presort: 各 mapper 排好序的缓冲区
+    int num_sorted;
+    long run_pairs;         // runs 和 sorted 中的 pair 数
 } Partition;
 
+// 发射缓冲区：每个 (mapper 线程, 分区) 一个，只有所属 mapper 写入，
+// 所以 MR_Emit 追加时无需加锁；Map 阶段结束后再拼接进各分区
+typedef struct {
+    KVPair *pairs;
+    int count;
+    int capacity;
+} __attribute__((aligned(64))) EmitBuffer;  // 按缓存行对齐，避免伪共享
+
 // 全局状态
 static Partition *partitions = NULL;
 static int num_partitions = 0;
 static Partitioner partition_func = NULL;
+static EmitBuffer *emit_buffers = NULL;     // [num_mappers][num_partitions]
+static int num_mapper_threads = 0;
+static Arena *arenas = NULL;                // 每个 mapper 一个，无需加锁
+static Arena shared_arena;                  // 其他线程共用，由 shared_lock 保护
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Getter 函数的状态（每个线程独立）
+// 溢写：每个 mapper 一个临时文件；它在内存里的 pair 和 arena 超过
+// spill_budget 时，把各分区的缓冲区排好序追加进文件，然后整体释放
 typedef struct {
-    char *current_key;
-    int partition_num;
-    int current_index;
-} GetterState;
+    FILE *file;
+    off_t offset;           // 已写入的字节数
+    size_t pairs;           // 内存中的 pair 数
+} __attribute__((aligned(64))) SpillFile;
+
+// 每个 mapper 的预算至少这么大，免得一次只溢写几个 pair；
+// reducer 一次最多同时读 SPILL_MAX_FANIN 段 run，每段一个读缓冲区
+#define SPILL_MIN_BUDGET (64 * 1024)
+#define SPILL_MAX_FANIN 16
 
-// 线程本地存储的 Getter 状态
-static __thread GetterState getter_state = {NULL, -1, 0};
+static size_t spill_budget = 0;             // 每个 mapper，0 表示不溢写
+static SpillFile *spill_files = NULL;
+static long spill_runs = 0;                 // 写出的 run 数（原子递增）
+static int presort = 0;                     // mapper 结束时排序自己的缓冲区
+
+// 当前线程的 mapper 编号（不是库创建的 mapper 线程时为 -1）
+static __thread int mapper_id = -1;
+
+// Combiner：每个 mapper 先把自己发射的 (key, value) 按 key 收集进一张
+// 哈希表，攒够 COMBINE_MAX_VALUES 个值（或 mapper 结束）时对每个 key
+// 调用一次 combine_func，由它 MR_EmitToReducer 合并后的结果
+#define COMBINE_MAX_VALUES (1 << 16)
+
+typedef struct ValueNode {
+    char *value;
+    struct ValueNode *next;
+} ValueNode;
 
-// 比较函数：用于排序 KV 对
-static int compare_kv_pairs(const void *a, const void *b) {
+typedef struct {
+    char *key;              // NULL 表示空槽
+    unsigned long hash;
+    ValueNode *head;        // 按发射顺序
+    ValueNode *tail;
+} CombineEntry;
+
+typedef struct {
+    CombineEntry *entries;
+    int capacity;           // 2 的幂
+    int count;              // 不同 key 的数量
+    int num_values;
+    Arena scratch;          // 表里的 key/value，flush 后整体释放
+} __attribute__((aligned(64))) CombineTable;
+
+static Combiner combine_func = NULL;
+static CombineTable *combine_tables = NULL;   // 每个 mapper 一个
+
+// combine_func 的 Getter 状态
+static __thread ValueNode *combine_cursor = NULL;
+
+
+// 排序用的临时记录：key 前 8 字节按大端存成整数，整数的大小顺序就是
+// 这 8 字节的 strcmp 顺序，大多数比较不用再去访问 key 字符串
+typedef struct {
+    unsigned long prefix;
+    KVPair pair;
+} SortItem;
+
+#define PREFIX_BYTES ((int)sizeof(unsigned long))
+
+static unsigned long key_prefix(const char *key) {
+    unsigned long prefix = 0;
+    int i = 0;
+    for (; i < PREFIX_BYTES && key[i] != '\0'; i++)
+        prefix = (prefix << 8) | (unsigned char)key[i];
+    return prefix << (8 * (PREFIX_BYTES - i));
+}
+
+// 前缀相同、且 key 长于前缀时，比较剩下的部分
+static int compare_kv_suffix(const void *a, const void *b) {
     const KVPair *pair_a = (const KVPair *)a;
     const KVPair *pair_b = (const KVPair *)b;
-    return strcmp(pair_a->key, pair_b->key);
+    return strcmp(pair_a->key + PREFIX_BYTES, pair_b->key + PREFIX_BYTES);
+}
+
+// 按 key 排序：对前缀做 LSD 基数排序（每趟 8 位，所有记录该字节
+// 都相同的趟直接跳过），再对前缀相同的长 key 段用 strcmp 排剩下的部分
+static void sort_pairs(KVPair *pairs, int n) {
+    if (n < 2)
+        return;
+    SortItem *items = malloc(n * sizeof(SortItem));
+    SortItem *aux = malloc(n * sizeof(SortItem));
+    if (!items || !aux) {
+        perror("malloc failed");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        items[i].prefix = key_prefix(pairs[i].key);
+        items[i].pair = pairs[i];
+    }
+    
+    for (int shift = 0; shift < 8 * PREFIX_BYTES; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; i++)
+            count[((items[i].prefix >> shift) & 0xff) + 1]++;
+        if (count[((items[0].prefix >> shift) & 0xff) + 1] == n)
+            continue;  // 这一字节全都一样
+        for (int b = 0; b < 256; b++)
+            count[b + 1] += count[b];
+        for (int i = 0; i < n; i++)
+            aux[count[(items[i].prefix >> shift) & 0xff]++] = items[i];
+        SortItem *tmp = items;
+        items = aux;
+        aux = tmp;
+    }
+    
+    for (int i = 0; i < n; i++)
+        pairs[i] = items[i].pair;
+    // 前缀最后一字节非 0，说明 key 至少有 PREFIX_BYTES 长，可能还没比完
+    for (int i = 0; i < n;) {
+        int j = i + 1;
+        while (j < n && items[j].prefix == items[i].prefix)
+            j++;
+        if (j - i > 1 && (items[i].prefix & 0xff) != 0)
+            qsort(pairs + i, j - i, sizeof(KVPair), compare_kv_suffix);
+        i = j;
+    }
+    free(items);
+    free(aux);
+}
+
+static void sort_partition(Partition *part) {
+    sort_pairs(part->pairs, part->count);
 }
 
 // 默认哈希分区函数
@@ -49,156 +229,872 @@ unsigned long MR_DefaultHashPartition(char *key, int num_partitions) {
     return hash % num_partitions;
 }
 
-// 扩展分区容量
-static void expand_partition(Partition *part) {
-    if (part->count >= part->capacity) {
-        int new_capacity = part->capacity == 0 ? 16 : part->capacity * 2;
-        KVPair *new_pairs = realloc(part->pairs, new_capacity * sizeof(KVPair));
+// 从 arena 分配 n 字节
+static char *arena_alloc(Arena *a, size_t n) {
+    ArenaChunk *c = a->chunks;
+    if (!c || c->size - c->used < n) {
+        size_t size = a->chunk_size ? a->chunk_size : ARENA_CHUNK_SIZE;
+        if (n > size)
+            size = n;
+        c = malloc(sizeof(ArenaChunk) + size);
+        if (!c) {
+            perror("malloc failed");
+            exit(1);
+        }
+        c->used = 0;
+        c->size = size;
+        c->next = a->chunks;
+        a->chunks = c;
+        a->bytes += sizeof(ArenaChunk) + size;
+    }
+    char *p = c->data + c->used;
+    c->used += n;
+    a->used += n;
+    return p;
+}
+
+static char *arena_strdup(Arena *a, const char *s, size_t len) {
+    char *p = arena_alloc(a, len + 1);
+    memcpy(p, s, len + 1);
+    return p;
+}
+
+// 复制一个值；短的值先查驻留表，命中则直接共用已有的那份
+static char *arena_intern(Arena *a, const char *value) {
+    size_t len = strlen(value);
+    if (len > INTERN_MAX_LEN)
+        return arena_strdup(a, value, len);
+    unsigned long hash = 5381;
+    for (size_t i = 0; i < len; i++)
+        hash = hash * 33 + (unsigned char)value[i];
+    char **slot = &a->interned[hash % INTERN_SLOTS];
+    if (*slot == NULL || strcmp(*slot, value) != 0)
+        *slot = arena_strdup(a, value, len);
+    return *slot;
+}
+
+// 释放整个 arena：O(块数)。块大小的设置保留
+static void arena_free(Arena *a) {
+    ArenaChunk *c = a->chunks;
+    while (c) {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    size_t chunk_size = a->chunk_size;
+    memset(a, 0, sizeof(*a));
+    a->chunk_size = chunk_size;
+}
+
+// 清空 arena 以便重用：保留当前块（其余的释放），不必每次重新 malloc
+static void arena_reset(Arena *a) {
+    ArenaChunk *c = a->chunks;
+    if (!c)
+        return;
+    ArenaChunk *rest = c->next;
+    while (rest) {
+        ArenaChunk *next = rest->next;
+        free(rest);
+        rest = next;
+    }
+    c->next = NULL;
+    c->used = 0;
+    a->bytes = sizeof(ArenaChunk) + c->size;
+    a->used = 0;
+    memset(a->interned, 0, sizeof(a->interned));
+}
+
+// combine_func 的 Getter：依次返回当前 key 收集到的值
+static char *combine_get_next(char *key) {
+    if (!combine_cursor)
+        return NULL;
+    char *value = combine_cursor->value;
+    combine_cursor = combine_cursor->next;
+    return value;
+}
+
+// 扩展 KV 数组容量（如果已满）
+static void expand_pairs(KVPair **pairs, int count, int *capacity) {
+    if (count >= *capacity) {
+        int new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        KVPair *new_pairs = realloc(*pairs, new_capacity * sizeof(KVPair));
         if (!new_pairs) {
             perror("realloc failed");
             exit(1);
         }
-        part->pairs = new_pairs;
-        part->capacity = new_capacity;
+        *pairs = new_pairs;
+        *capacity = new_capacity;
     }
 }
 
-// MR_Emit: 线程安全地存储 key/value 对
-void MR_Emit(char *key, char *value) {
-    if (!partitions || !partition_func) {
-        fprintf(stderr, "MR_Emit called before MR_Run\n");
-        return;
+// 溢写文件放在 $TMPDIR（默认 /tmp），创建后立即删除，关闭时自动回收
+static FILE *open_spill_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/mapreduce-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp failed");
+        exit(1);
     }
+    unlink(path);
+    FILE *file = fdopen(fd, "w+");
+    if (!file) {
+        perror("fdopen failed");
+        exit(1);
+    }
+    return file;
+}
+
+// 把 mapper m 内存中的 pair 按分区排序后写成一段段 run，再释放它的 arena
+static void spill_mapper(int m) {
+    SpillFile *f = &spill_files[m];
+    if (!f->file)
+        f->file = open_spill_file();
     
+    for (int p = 0; p < num_partitions; p++) {
+        EmitBuffer *buf = &emit_buffers[m * num_partitions + p];
+        if (buf->count == 0)
+            continue;
+        sort_pairs(buf->pairs, buf->count);
+        SpillRun run = {fileno(f->file), f->offset, 0};
+        for (int i = 0; i < buf->count; i++) {
+            size_t key_len = strlen(buf->pairs[i].key) + 1;
+            size_t value_len = strlen(buf->pairs[i].value) + 1;
+            if (fwrite(buf->pairs[i].key, 1, key_len, f->file) != key_len ||
+                fwrite(buf->pairs[i].value, 1, value_len, f->file) != value_len) {
+                perror("spill write failed");
+                exit(1);
+            }
+            run.length += key_len + value_len;
+        }
+        f->offset += run.length;
+        
+        Partition *part = &partitions[p];
+        pthread_mutex_lock(&part->lock);
+        if (part->num_runs == part->runs_capacity) {
+            int new_capacity = part->runs_capacity == 0 ? 8 : part->runs_capacity * 2;
+            SpillRun *new_runs = realloc(part->runs, new_capacity * sizeof(SpillRun));
+            if (!new_runs) {
+                perror("realloc failed");
+                exit(1);
+            }
+            part->runs = new_runs;
+            part->runs_capacity = new_capacity;
+        }
+        part->runs[part->num_runs++] = run;
+        part->run_pairs += buf->count;
+        pthread_mutex_unlock(&part->lock);
+        __atomic_fetch_add(&spill_runs, 1, __ATOMIC_RELAXED);
+        buf->count = 0;
+    }
+    // reducer 用 pread 读，写完的数据必须已经离开 stdio 缓冲区
+    if (fflush(f->file) != 0) {
+        perror("spill write failed");
+        exit(1);
+    }
+    f->pairs = 0;
+    arena_free(&arenas[m]);
+}
+
+// 存储一个 key/value 对（不经过 combiner）
+static void emit_pair(char *key, char *value) {
     // 确定分区
     unsigned long partition_num = partition_func(key, num_partitions);
-    Partition *part = &partitions[partition_num];
     
-    // 加锁保护
-    pthread_mutex_lock(&part->lock);
-    
-    // 扩展容量（如果需要）
-    expand_partition(part);
-    
-    // 复制 key 和 value
-    KVPair *pair = &part->pairs[part->count];
-    pair->key = strdup(key);
-    pair->value = strdup(value);
+    // 快速路径：复制到本 mapper 的 arena，追加到它自己的缓冲区，无锁
+    if (mapper_id >= 0) {
+        Arena *a = &arenas[mapper_id];
+        KVPair pair = {arena_strdup(a, key, strlen(key)), arena_intern(a, value)};
+        EmitBuffer *buf = &emit_buffers[mapper_id * num_partitions + partition_num];
+        expand_pairs(&buf->pairs, buf->count, &buf->capacity);
+        buf->pairs[buf->count++] = pair;
+        if (spill_budget) {
+            SpillFile *f = &spill_files[mapper_id];
+            if (a->used + ++f->pairs * sizeof(KVPair) > spill_budget)
+                spill_mapper(mapper_id);
+        }
+        return;
+    }
     
-    if (!pair->key || !pair->value) {
-        perror("strdup failed");
+    // 其他线程（例如 Map 函数自己创建的线程）：加锁直接写入分区
+    pthread_mutex_lock(&shared_lock);
+    KVPair pair = {arena_strdup(&shared_arena, key, strlen(key)),
+                   arena_intern(&shared_arena, value)};
+    pthread_mutex_unlock(&shared_lock);
+    Partition *part = &partitions[partition_num];
+    pthread_mutex_lock(&part->lock);
+    expand_pairs(&part->pairs, part->count, &part->capacity);
+    part->pairs[part->count++] = pair;
+    pthread_mutex_unlock(&part->lock);
+}
+
+static unsigned long hash_key(char *key) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *key++) != '\0')
+        hash = hash * 33 + c;
+    return hash;
+}
+
+// 把所有已收集的 key 交给 combine_func，然后清空哈希表
+static void combine_flush(CombineTable *t) {
+    for (int i = 0; i < t->capacity; i++) {
+        CombineEntry *e = &t->entries[i];
+        if (e->key) {
+            combine_cursor = e->head;
+            combine_func(e->key, combine_get_next);
+            e->key = NULL;
+        }
+    }
+    t->count = 0;
+    t->num_values = 0;
+    arena_free(&t->scratch);
+}
+
+// 哈希表扩容到两倍（线性探测）
+static void combine_grow(CombineTable *t) {
+    int old_capacity = t->capacity;
+    CombineEntry *old = t->entries;
+    t->capacity = old_capacity ? old_capacity * 2 : 1024;
+    t->entries = calloc(t->capacity, sizeof(CombineEntry));
+    if (!t->entries) {
+        perror("calloc failed");
         exit(1);
     }
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].key) {
+            int j = old[i].hash & (t->capacity - 1);
+            while (t->entries[j].key)
+                j = (j + 1) & (t->capacity - 1);
+            t->entries[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// 把一个值加入本 mapper 的哈希表
+static void combine_add(CombineTable *t, char *key, char *value) {
+    if (t->count * 2 >= t->capacity)
+        combine_grow(t);
+    unsigned long hash = hash_key(key);
+    int i = hash & (t->capacity - 1);
+    CombineEntry *e;
+    while ((e = &t->entries[i])->key &&
+           (e->hash != hash || strcmp(e->key, key) != 0))
+        i = (i + 1) & (t->capacity - 1);
     
-    part->count++;
+    ValueNode *node = (ValueNode *)arena_alloc(&t->scratch, sizeof(ValueNode));
+    node->value = arena_intern(&t->scratch, value);
+    node->next = NULL;
+    if (!e->key) {
+        e->key = arena_strdup(&t->scratch, key, strlen(key));
+        e->hash = hash;
+        e->head = node;
+        t->count++;
+    } else {
+        e->tail->next = node;
+    }
+    e->tail = node;
     
-    pthread_mutex_unlock(&part->lock);
+    if (++t->num_values >= COMBINE_MAX_VALUES)
+        combine_flush(t);
 }
 
-// Getter 函数：供 Reduce 函数迭代获取值
-static char *get_next_value(char *key, int partition_number) {
+// MR_Emit: 线程安全地存储 key/value 对（有 combiner 时先交给它）
+void MR_Emit(char *key, char *value) {
+    if (!partitions || !partition_func) {
+        fprintf(stderr, "MR_Emit called before MR_Run\n");
+        return;
+    }
+    if (combine_func && mapper_id >= 0) {
+        combine_add(&combine_tables[mapper_id], key, value);
+        return;
+    }
+    emit_pair(key, value);
+}
+
+void MR_EmitToReducer(char *key, char *value) {
+    if (!partitions || !partition_func) {
+        fprintf(stderr, "MR_EmitToReducer called before MR_Run\n");
+        return;
+    }
+    emit_pair(key, value);
+}
+
+// Map 阶段结束后：把各 mapper 的缓冲区按 mapper 顺序拼接进分区
+// （presort 模式下它们已经有序，直接交给分区等着归并）
+static void merge_emit_buffers(void) {
+    for (int p = 0; p < num_partitions; p++) {
+        Partition *part = &partitions[p];
+        if (presort) {
+            part->sorted = malloc(num_mapper_threads * sizeof(SortedRun));
+            if (!part->sorted) {
+                perror("malloc failed");
+                exit(1);
+            }
+            for (int m = 0; m < num_mapper_threads; m++) {
+                EmitBuffer *buf = &emit_buffers[m * num_partitions + p];
+                if (buf->count > 0) {
+                    part->sorted[part->num_sorted++] = (SortedRun) {buf->pairs, buf->count};
+                    part->run_pairs += buf->count;
+                } else {
+                    free(buf->pairs);
+                }
+            }
+            continue;
+        }
+        int total = part->count;
+        for (int m = 0; m < num_mapper_threads; m++)
+            total += emit_buffers[m * num_partitions + p].count;
+        if (total > part->capacity) {
+            KVPair *new_pairs = realloc(part->pairs, total * sizeof(KVPair));
+            if (!new_pairs) {
+                perror("realloc failed");
+                exit(1);
+            }
+            part->pairs = new_pairs;
+            part->capacity = total;
+        }
+        for (int m = 0; m < num_mapper_threads; m++) {
+            EmitBuffer *buf = &emit_buffers[m * num_partitions + p];
+            if (buf->count > 0)
+                memcpy(part->pairs + part->count, buf->pairs,
+                       buf->count * sizeof(KVPair));
+            part->count += buf->count;
+            free(buf->pairs);
+        }
+    }
+    free(emit_buffers);
+    emit_buffers = NULL;
+    num_mapper_threads = 0;
+}
+
+// 找到 key 在分区中的值区间
+// 通常就是正在 Reduce 的 key（传入的正是我们给出的指针，不用比较），
+// 否则二分查找，并记下位置供之后继续迭代；分区里没有这个 key 时返回 NULL
+static ValueCursor *find_cursor(char *key, int partition_number) {
     Partition *part = &partitions[partition_number];
+    if (key == part->current.key)
+        return &part->current;
+    if (part->current.key && strcmp(key, part->current.key) == 0)
+        return &part->current;
+    for (int i = 0; i < part->num_others; i++)
+        if (strcmp(key, part->others[i].key) == 0)
+            return &part->others[i];
     
-    // 如果 key 改变或分区改变，重置索引
-    // 使用字符串内容比较，而不是指针比较
-    if (getter_state.current_key == NULL || 
-        getter_state.partition_num != partition_number ||
-        strcmp(getter_state.current_key, key) != 0) {
-        getter_state.current_key = key;
-        getter_state.partition_num = partition_number;
-        getter_state.current_index = 0;
+    // [lo, hi) 中第一个 >= key 的位置
+    int lo = 0, hi = part->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(part->pairs[mid].key, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    if (lo == part->count || strcmp(part->pairs[lo].key, key) != 0)
+        return NULL;
+    int end = lo + 1;
+    while (end < part->count && strcmp(part->pairs[end].key, key) == 0)
+        end++;
     
-    // 由于分区已排序，同一个 key 的所有值应该是连续的
-    // 查找匹配的 key
-    while (getter_state.current_index < part->count) {
-        KVPair *pair = &part->pairs[getter_state.current_index];
-        if (strcmp(pair->key, key) == 0) {
-            char *value = pair->value;
-            getter_state.current_index++;
-            return value;
-        }
-        // 如果已经过了这个 key 的范围（因为已排序），停止查找
-        if (strcmp(pair->key, key) > 0) {
-            break;
+    if (part->num_others == part->others_capacity) {
+        int new_capacity = part->others_capacity == 0 ? 4 : part->others_capacity * 2;
+        ValueCursor *new_others = realloc(part->others, new_capacity * sizeof(ValueCursor));
+        if (!new_others) {
+            perror("realloc failed");
+            exit(1);
         }
-        getter_state.current_index++;
+        part->others = new_others;
+        part->others_capacity = new_capacity;
     }
-    
-    return NULL;
+    ValueCursor *c = &part->others[part->num_others++];
+    c->key = part->pairs[lo].key;
+    c->next = lo;
+    c->end = end;
+    return c;
 }
 
+// Getter 函数：供 Reduce 函数迭代获取值，每次只是前移下标
+static char *get_next_value(char *key, int partition_number) {
+    ValueCursor *c = find_cursor(key, partition_number);
+    if (!c || c->next == c->end)
+        return NULL;
+    return partitions[partition_number].pairs[c->next++].value;
+}
+
+// 批量取值：最多 max_values 个还没取过的值放进 values，返回个数
+int MR_GetValues(char *key, int partition_number, char **values, int max_values) {
+    ValueCursor *c = find_cursor(key, partition_number);
+    if (!c)
+        return 0;
+    KVPair *pairs = partitions[partition_number].pairs;
+    int n = 0;
+    while (n < max_values && c->next < c->end)
+        values[n++] = pairs[c->next++].value;
+    return n;
+}
+
+// 还没取过的值的个数（不取走）
+int MR_ValuesLeft(char *key, int partition_number) {
+    ValueCursor *c = find_cursor(key, partition_number);
+    return c ? c->end - c->next : 0;
+}
+
+// Map 任务：文件 file 的 [offset, offset + length)
+typedef struct {
+    int file;
+    size_t offset;
+    size_t length;
+} MapTask;
+
 // Mapper 线程参数
 typedef struct {
+    int mapper_id;
     char **files;
-    int num_files;
-    int *next_file_index;
-    pthread_mutex_t *file_lock;
+    int num_tasks;          // 整文件模式下就是文件数
+    int *next_task_index;
+    pthread_mutex_t *task_lock;
     Mapper map_func;
+    RangeMapper map_range_func;
+    MapTask *tasks;         // 仅分片模式
+    char **mapped;          // 各文件 mmap 的起始地址（仅分片模式）
 } MapperArgs;
 
 // Mapper 线程函数  
 static void *mapper_thread(void *arg) {
     MapperArgs *args = (MapperArgs *)arg;
+    mapper_id = args->mapper_id;
     
     while (1) {
-        int file_index = -1;
+        int task_index = -1;
         
-        // 获取下一个文件
-        pthread_mutex_lock(args->file_lock);
-        if (*args->next_file_index < args->num_files) {
-            file_index = (*args->next_file_index)++;
+        // 获取下一个任务
+        pthread_mutex_lock(args->task_lock);
+        if (*args->next_task_index < args->num_tasks) {
+            task_index = (*args->next_task_index)++;
         }
-        pthread_mutex_unlock(args->file_lock);
+        pthread_mutex_unlock(args->task_lock);
         
-        if (file_index == -1) {
-            break;  // 没有更多文件
+        if (task_index == -1) {
+            break;  // 没有更多任务
         }
         
         // 调用用户的 Map 函数
-        args->map_func(args->files[file_index]);
+        if (args->map_range_func) {
+            MapTask *t = &args->tasks[task_index];
+            args->map_range_func(args->files[t->file], args->mapped[t->file] + t->offset,
+                                 t->offset, t->length);
+        } else {
+            args->map_func(args->files[task_index]);
+        }
+    }
+    
+    // 把哈希表里剩下的交给 combiner
+    if (combine_func) {
+        CombineTable *t = &combine_tables[mapper_id];
+        combine_flush(t);
+        free(t->entries);
+        t->entries = NULL;
+    }
+    
+    // 溢写过的 mapper 把剩下的也写出去，它的内存就全部还掉了
+    if (spill_budget && spill_files[mapper_id].file) {
+        spill_mapper(mapper_id);
+    } else if (presort) {
+        // 趁其他 mapper 还在跑，先把自己的输出排好序
+        for (int p = 0; p < num_partitions; p++) {
+            EmitBuffer *buf = &emit_buffers[mapper_id * num_partitions + p];
+            sort_pairs(buf->pairs, buf->count);
+        }
     }
     
+    mapper_id = -1;
     return NULL;
 }
 
-// Reducer 线程参数
+// Reducer 线程参数（所有 reducer 共用）
 typedef struct {
-    int partition_num;
+    int *order;             // 分区编号，按 count 从大到小
+    int *next_index;        // order 中下一个待领取的位置（原子递增）
     Reducer reduce_func;
 } ReducerArgs;
 
 // Reducer 线程函数
-static void *reducer_thread(void *arg) {
-    ReducerArgs *args = (ReducerArgs *)arg;
-    Partition *part = &partitions[args->partition_num];
+// 归并的一路输入：排好序的内存数组，或者文件中的一段 run
+#define SPILL_READ_SIZE (64 * 1024)
+
+typedef struct {
+    char *key;              // 当前记录，NULL 表示读完
+    char *value;
+    int in_memory;
+    KVPair *pairs;          // 内存中的部分
+    int next;
+    int count;
+    int fd;                 // 文件中还没读进 buf 的是 [offset, end)
+    off_t offset;
+    off_t end;
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;
+} MergeSource;
+
+// 前移到下一条记录。文件中的记录直接指向 buf，下次前移时才会失效
+static void source_advance(MergeSource *s) {
+    if (s->in_memory) {
+        if (s->next < s->count) {
+            s->key = s->pairs[s->next].key;
+            s->value = s->pairs[s->next].value;
+            s->next++;
+        } else {
+            s->key = NULL;
+        }
+        return;
+    }
+    while (1) {
+        char *key_end = memchr(s->buf + s->pos, '\0', s->len - s->pos);
+        char *value_end = key_end ? memchr(key_end + 1, '\0', s->buf + s->len - key_end - 1) : NULL;
+        if (value_end) {
+            s->key = s->buf + s->pos;
+            s->value = key_end + 1;
+            s->pos = value_end + 1 - s->buf;
+            return;
+        }
+        if (s->offset == s->end) {
+            s->key = NULL;
+            return;
+        }
+        // 记录不完整：把剩下的挪到开头，缓冲区满了就加倍，再读
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+        if (s->len == s->size) {
+            s->size *= 2;
+            s->buf = realloc(s->buf, s->size);
+            if (!s->buf) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+        size_t want = s->size - s->len;
+        if ((off_t)want > s->end - s->offset)
+            want = s->end - s->offset;
+        ssize_t rc = pread(s->fd, s->buf + s->len, want, s->offset);
+        if (rc <= 0) {
+            perror("spill read failed");
+            exit(1);
+        }
+        s->len += rc;
+        s->offset += rc;
+    }
+}
+
+// 最小堆（按当前 key）的下沉
+static void heap_down(MergeSource **heap, int n, int i) {
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && strcmp(heap[l]->key, heap[smallest]->key) < 0)
+            smallest = l;
+        if (r < n && strcmp(heap[r]->key, heap[smallest]->key) < 0)
+            smallest = r;
+        if (smallest == i)
+            return;
+        MergeSource *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// 从文件中的一段 run 读
+static void source_open_run(MergeSource *s, SpillRun *run) {
+    s->fd = run->fd;
+    s->offset = run->offset;
+    s->end = run->offset + run->length;
+    s->size = SPILL_READ_SIZE;
+    s->buf = malloc(s->size);
+    if (!s->buf) {
+        perror("malloc failed");
+        exit(1);
+    }
+}
+
+// 把 runs[0, count) 归并成一段新的 run，追加到分区的 merge_file
+static SpillRun merge_runs(Partition *part, SpillRun *runs, int count) {
+    if (!part->merge_file)
+        part->merge_file = open_spill_file();
+    MergeSource *sources = calloc(count, sizeof(MergeSource));
+    MergeSource **heap = malloc(count * sizeof(MergeSource *));
+    if (!sources || !heap) {
+        perror("malloc failed");
+        exit(1);
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        source_open_run(&sources[i], &runs[i]);
+        source_advance(&sources[i]);
+        if (sources[i].key)
+            heap[n++] = &sources[i];
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        heap_down(heap, n, i);
+    
+    SpillRun run = {fileno(part->merge_file), part->merge_offset, 0};
+    while (n > 0) {
+        MergeSource *s = heap[0];
+        size_t key_len = strlen(s->key) + 1;
+        size_t value_len = strlen(s->value) + 1;
+        if (fwrite(s->key, 1, key_len, part->merge_file) != key_len ||
+            fwrite(s->value, 1, value_len, part->merge_file) != value_len) {
+            perror("spill write failed");
+            exit(1);
+        }
+        run.length += key_len + value_len;
+        source_advance(s);
+        if (!s->key)
+            heap[0] = heap[--n];
+        heap_down(heap, n, 0);
+    }
+    if (fflush(part->merge_file) != 0) {
+        perror("spill write failed");
+        exit(1);
+    }
+    part->merge_offset += run.length;
+    
+    for (int i = 0; i < count; i++)
+        free(sources[i].buf);
+    free(sources);
+    free(heap);
+    return run;
+}
+
+// run 超过 SPILL_MAX_FANIN 段时，每 SPILL_MAX_FANIN 段归并成一段，
+// 直到剩下的可以一次读完
+static void reduce_fan_in(Partition *part) {
+    while (part->num_runs > SPILL_MAX_FANIN) {
+        int merged = 0;
+        for (int i = 0; i < part->num_runs; i += SPILL_MAX_FANIN) {
+            int count = part->num_runs - i < SPILL_MAX_FANIN ? part->num_runs - i : SPILL_MAX_FANIN;
+            part->runs[merged++] = count == 1 ? part->runs[i] : merge_runs(part, &part->runs[i], count);
+        }
+        part->num_runs = merged;
+    }
+}
+
+// 有 run 的分区：把内存中的部分和所有 run（排好序的内存缓冲区、溢写文件）
+// 做 k 路归并，每次只把一个 key 的值复制进 pairs，Reduce 函数看到的就和
+// 全在内存时一样
+static void reduce_merged_partition(int partition_num, Reducer reduce_func) {
+    Partition *part = &partitions[partition_num];
+    sort_partition(part);
+    reduce_fan_in(part);
+    
+    int num_sources = 1 + part->num_sorted + part->num_runs;
+    MergeSource *sources = calloc(num_sources, sizeof(MergeSource));
+    MergeSource **heap = malloc(num_sources * sizeof(MergeSource *));
+    if (!sources || !heap) {
+        perror("malloc failed");
+        exit(1);
+    }
+    // 内存中的部分交给第 0 路，pairs 改用来放当前 key 的值
+    sources[0].in_memory = 1;
+    sources[0].pairs = part->pairs;
+    sources[0].count = part->count;
+    part->pairs = NULL;
+    part->count = 0;
+    part->capacity = 0;
+    for (int i = 0; i < part->num_sorted; i++) {
+        MergeSource *s = &sources[1 + i];
+        s->in_memory = 1;
+        s->pairs = part->sorted[i].pairs;
+        s->count = part->sorted[i].count;
+    }
+    for (int i = 0; i < part->num_runs; i++)
+        source_open_run(&sources[1 + part->num_sorted + i], &part->runs[i]);
+    
+    int n = 0;
+    for (int i = 0; i < num_sources; i++) {
+        source_advance(&sources[i]);
+        if (sources[i].key)
+            heap[n++] = &sources[i];
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        heap_down(heap, n, i);
+    
+    Arena group = {0};      // 当前 key 及其值：通常只有几个字节，用小块
+    group.chunk_size = 4096;
+    while (n > 0) {
+        char *current_key = arena_strdup(&group, heap[0]->key, strlen(heap[0]->key));
+        part->count = 0;
+        while (n > 0 && strcmp(heap[0]->key, current_key) == 0) {
+            expand_pairs(&part->pairs, part->count, &part->capacity);
+            part->pairs[part->count++] = (KVPair) {current_key, arena_intern(&group, heap[0]->value)};
+            source_advance(heap[0]);
+            if (!heap[0]->key)
+                heap[0] = heap[--n];
+            heap_down(heap, n, 0);
+        }
+        
+        part->current.key = current_key;
+        part->current.next = 0;
+        part->current.end = part->count;
+        part->num_others = 0;
+        reduce_func(current_key, get_next_value, partition_num);
+        arena_reset(&group);
+    }
+    arena_free(&group);
+    part->current.key = NULL;
+    part->count = 0;
     
-    // 遍历分区中所有唯一的 key
-    char *last_key = NULL;
-    for (int i = 0; i < part->count; i++) {
+    for (int i = 0; i < num_sources; i++) {
+        free(sources[i].pairs);
+        free(sources[i].buf);
+    }
+    part->num_sorted = 0;
+    free(sources);
+    free(heap);
+}
+
+static void reduce_partition(int partition_num, Reducer reduce_func) {
+    Partition *part = &partitions[partition_num];
+    if (part->num_runs > 0 || part->num_sorted > 0) {
+        reduce_merged_partition(partition_num, reduce_func);
+        return;
+    }
+    
+    // 由领到它的 reducer 排序，各分区并行
+    sort_partition(part);
+    
+    // 遍历分区中所有唯一的 key：相同的 key 已经相邻，[i, end) 是一组
+    int i = 0;
+    while (i < part->count) {
         char *current_key = part->pairs[i].key;
+        int end = i + 1;
+        while (end < part->count && strcmp(part->pairs[end].key, current_key) == 0)
+            end++;
         
-        // 如果是新的 key，调用 Reduce
-        if (!last_key || strcmp(current_key, last_key) != 0) {
-            // 重置 getter 状态
-            getter_state.current_key = NULL;
-            getter_state.partition_num = -1;
-            getter_state.current_index = 0;
-            
-            // 调用用户的 Reduce 函数
-            args->reduce_func(current_key, get_next_value, args->partition_num);
-            last_key = current_key;
+        part->current.key = current_key;
+        part->current.next = i;
+        part->current.end = end;
+        part->num_others = 0;
+        
+        // 调用用户的 Reduce 函数
+        reduce_func(current_key, get_next_value, partition_num);
+        i = end;
+    }
+    part->current.key = NULL;
+}
+
+// Reducer 线程函数：不断领取剩下的最大分区
+static void *reducer_thread(void *arg) {
+    ReducerArgs *args = (ReducerArgs *)arg;
+    
+    while (1) {
+        int index = __atomic_fetch_add(args->next_index, 1, __ATOMIC_RELAXED);
+        if (index >= num_partitions) {
+            break;  // 没有更多分区
         }
+        reduce_partition(args->order[index], args->reduce_func);
     }
     
     return NULL;
 }
 
+// 按分区大小从大到小
+static int compare_partition_size(const void *a, const void *b) {
+    Partition *part_a = &partitions[*(const int *)a];
+    Partition *part_b = &partitions[*(const int *)b];
+    long count_a = part_a->count + part_a->run_pairs;
+    long count_b = part_b->count + part_b->run_pairs;
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+// 把每个文件 mmap 进来，按 split_size 切成以换行结尾的片段，
+// 这样一个大文件也能分给所有 mapper。返回任务数
+static int split_files(char **files, int num_files, size_t split_size,
+                       char **mapped, size_t *sizes, MapTask **tasks_out) {
+    int num_tasks = 0, capacity = 0;
+    MapTask *tasks = NULL;
+    
+    for (int f = 0; f < num_files; f++) {
+        mapped[f] = NULL;
+        sizes[f] = 0;
+        int fd = open(files[f], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(files[f]);
+            exit(1);
+        }
+        sizes[f] = st.st_size;
+        if (sizes[f] > 0) {
+            mapped[f] = mmap(NULL, sizes[f], PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped[f] == MAP_FAILED) {
+                perror(files[f]);
+                exit(1);
+            }
+            madvise(mapped[f], sizes[f], MADV_SEQUENTIAL);
+        }
+        close(fd);  // 映射在关闭后仍然有效
+        
+        size_t start = 0;
+        while (start < sizes[f]) {
+            size_t end = sizes[f];
+            if (sizes[f] - start > split_size) {
+                // 延伸到下一个换行之后，一行不会被两个任务各拿一半
+                char *nl = memchr(mapped[f] + start + split_size, '\n',
+                                  sizes[f] - start - split_size);
+                if (nl)
+                    end = nl - mapped[f] + 1;
+            }
+            if (num_tasks == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                tasks = realloc(tasks, capacity * sizeof(MapTask));
+                if (!tasks) {
+                    perror("realloc failed");
+                    exit(1);
+                }
+            }
+            tasks[num_tasks++] = (MapTask) { f, start, end - start };
+            start = end;
+        }
+    }
+    *tasks_out = tasks;
+    return num_tasks;
+}
+
 // MR_Run: 主函数
 void MR_Run(int argc, char *argv[], 
             Mapper map, int num_mappers, 
             Reducer reduce, int num_reducers, 
             Partitioner partition) {
+    MR_RunWithCombiner(argc, argv, map, num_mappers, NULL,
+                       reduce, num_reducers, partition);
+}
+
+void MR_RunWithCombiner(int argc, char *argv[],
+                        Mapper map, int num_mappers,
+                        Combiner combine,
+                        Reducer reduce, int num_reducers,
+                        Partitioner partition) {
+    MR_Options options = {
+        .map = map,
+        .num_mappers = num_mappers,
+        .combine = combine,
+        .reduce = reduce,
+        .num_reducers = num_reducers,
+        .partition = partition
+    };
+    MR_RunWithOptions(argc, argv, &options);
+}
+
+void MR_RunWithOptions(int argc, char *argv[], MR_Options *options) {
+    Mapper map = options->map;
+    RangeMapper map_range = options->map_range;
+    int num_mappers = options->num_mappers;
+    Combiner combine = options->combine;
+    Reducer reduce = options->reduce;
+    int num_reducers = options->num_reducers;
     
     if (argc < 2) {
         fprintf(stderr, "Usage: %s file1 file2 ...\n", argv[0]);
@@ -206,8 +1102,8 @@ void MR_Run(int argc, char *argv[],
     }
     
     // 保存分区函数
-    partition_func = partition;
-    num_partitions = num_reducers;
+    partition_func = options->partition ? options->partition : MR_DefaultHashPartition;
+    num_partitions = options->num_partitions > 0 ? options->num_partitions : num_reducers;
     
     // 初始化分区
     partitions = malloc(num_partitions * sizeof(Partition));
@@ -220,37 +1116,108 @@ void MR_Run(int argc, char *argv[],
         partitions[i].pairs = NULL;
         partitions[i].count = 0;
         partitions[i].capacity = 0;
+        partitions[i].current.key = NULL;
+        partitions[i].others = NULL;
+        partitions[i].num_others = 0;
+        partitions[i].others_capacity = 0;
+        partitions[i].runs = NULL;
+        partitions[i].num_runs = 0;
+        partitions[i].runs_capacity = 0;
+        partitions[i].merge_file = NULL;
+        partitions[i].merge_offset = 0;
+        partitions[i].sorted = NULL;
+        partitions[i].num_sorted = 0;
+        partitions[i].run_pairs = 0;
         if (pthread_mutex_init(&partitions[i].lock, NULL) != 0) {
             perror("pthread_mutex_init failed");
             exit(1);
         }
     }
     
-    // 准备文件列表
+    // 准备文件列表（分片模式下还要切成任务）
     int num_files = argc - 1;
     char **files = &argv[1];
+    int num_tasks = num_files;
+    MapTask *tasks = NULL;
+    char **mapped = NULL;
+    size_t *sizes = NULL;
+    if (map_range) {
+        mapped = malloc(num_files * sizeof(char *));
+        sizes = malloc(num_files * sizeof(size_t));
+        if (!mapped || !sizes) {
+            perror("malloc failed");
+            exit(1);
+        }
+        size_t split_size = options->split_size > 0 ? options->split_size : MR_DEFAULT_SPLIT_SIZE;
+        num_tasks = split_files(files, num_files, split_size, mapped, sizes, &tasks);
+    }
     
     // ========== Map 阶段 ==========
     pthread_t *mapper_threads = malloc(num_mappers * sizeof(pthread_t));
-    if (!mapper_threads) {
+    MapperArgs *mapper_args = malloc(num_mappers * sizeof(MapperArgs));
+    if (!mapper_threads || !mapper_args) {
         perror("malloc failed");
         exit(1);
     }
     
-    int next_file_index = 0;
-    pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+    // 每个 (mapper, 分区) 一个发射缓冲区
+    num_mapper_threads = num_mappers;
+    emit_buffers = aligned_alloc(64, num_mappers * num_partitions * sizeof(EmitBuffer));
+    if (!emit_buffers) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memset(emit_buffers, 0, num_mappers * num_partitions * sizeof(EmitBuffer));
+    arenas = aligned_alloc(64, num_mappers * sizeof(Arena));
+    if (!arenas) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memset(arenas, 0, num_mappers * sizeof(Arena));
+    if (options->memory_budget > 0) {
+        spill_budget = (options->memory_budget + num_mappers - 1) / num_mappers;
+        if (spill_budget < SPILL_MIN_BUDGET)
+            spill_budget = SPILL_MIN_BUDGET;
+        // 块也不能比预算大，否则第一块就超了
+        if (spill_budget / 4 < ARENA_CHUNK_SIZE)
+            for (int i = 0; i < num_mappers; i++)
+                arenas[i].chunk_size = spill_budget / 4;
+        spill_runs = 0;
+        spill_files = aligned_alloc(64, num_mappers * sizeof(SpillFile));
+        if (!spill_files) {
+            perror("malloc failed");
+            exit(1);
+        }
+        memset(spill_files, 0, num_mappers * sizeof(SpillFile));
+    }
+    presort = options->presort;
+    combine_func = combine;
+    if (combine) {
+        combine_tables = aligned_alloc(64, num_mappers * sizeof(CombineTable));
+        if (!combine_tables) {
+            perror("malloc failed");
+            exit(1);
+        }
+        memset(combine_tables, 0, num_mappers * sizeof(CombineTable));
+    }
     
-    MapperArgs mapper_args = {
-        .files = files,
-        .num_files = num_files,
-        .next_file_index = &next_file_index,
-        .file_lock = &file_lock,
-        .map_func = map
-    };
+    int next_task_index = 0;
+    pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
     
     // 创建 mapper 线程
     for (int i = 0; i < num_mappers; i++) {
-        if (pthread_create(&mapper_threads[i], NULL, mapper_thread, &mapper_args) != 0) {
+        mapper_args[i] = (MapperArgs) {
+            .mapper_id = i,
+            .files = files,
+            .num_tasks = num_tasks,
+            .next_task_index = &next_task_index,
+            .task_lock = &task_lock,
+            .map_func = map,
+            .map_range_func = map_range,
+            .tasks = tasks,
+            .mapped = mapped
+        };
+        if (pthread_create(&mapper_threads[i], NULL, mapper_thread, &mapper_args[i]) != 0) {
             perror("pthread_create failed");
             exit(1);
         }
@@ -262,35 +1229,49 @@ void MR_Run(int argc, char *argv[],
     }
     
     free(mapper_threads);
-    pthread_mutex_destroy(&file_lock);
+    free(mapper_args);
+    free(combine_tables);
+    combine_tables = NULL;
+    combine_func = NULL;
+    pthread_mutex_destroy(&task_lock);
     
-    // ========== 排序阶段 ==========
-    for (int i = 0; i < num_partitions; i++) {
-        Partition *part = &partitions[i];
-        if (part->count > 0) {
-            qsort(part->pairs, part->count, sizeof(KVPair), compare_kv_pairs);
+    // 发射的 key/value 都已拷贝进 arena，映射可以解除了
+    if (map_range) {
+        for (int f = 0; f < num_files; f++) {
+            if (mapped[f])
+                munmap(mapped[f], sizes[f]);
         }
+        free(mapped);
+        free(sizes);
+        free(tasks);
     }
     
+    // 拼接各 mapper 的发射缓冲区
+    merge_emit_buffers();
+    
     // ========== Reduce 阶段 ==========
     pthread_t *reducer_threads = malloc(num_reducers * sizeof(pthread_t));
-    if (!reducer_threads) {
+    int *order = malloc(num_partitions * sizeof(int));
+    if (!reducer_threads || !order) {
         perror("malloc failed");
         exit(1);
     }
     
-    ReducerArgs *reducer_args = malloc(num_reducers * sizeof(ReducerArgs));
-    if (!reducer_args) {
-        perror("malloc failed");
-        exit(1);
-    }
+    // 大分区先处理，免得最后剩一个大分区拖慢整个任务
+    for (int i = 0; i < num_partitions; i++)
+        order[i] = i;
+    qsort(order, num_partitions, sizeof(int), compare_partition_size);
+    
+    int next_partition_index = 0;
+    ReducerArgs reducer_args = {
+        .order = order,
+        .next_index = &next_partition_index,
+        .reduce_func = reduce
+    };
     
     // 创建 reducer 线程
     for (int i = 0; i < num_reducers; i++) {
-        reducer_args[i].partition_num = i;
-        reducer_args[i].reduce_func = reduce;
-        
-        if (pthread_create(&reducer_threads[i], NULL, reducer_thread, &reducer_args[i]) != 0) {
+        if (pthread_create(&reducer_threads[i], NULL, reducer_thread, &reducer_args) != 0) {
             perror("pthread_create failed");
             exit(1);
         }
@@ -302,19 +1283,39 @@ void MR_Run(int argc, char *argv[],
     }
     
     free(reducer_threads);
-    free(reducer_args);
+    free(order);
     
     // ========== 清理阶段 ==========
     for (int i = 0; i < num_partitions; i++) {
         Partition *part = &partitions[i];
-        for (int j = 0; j < part->count; j++) {
-            free(part->pairs[j].key);
-            free(part->pairs[j].value);
-        }
         free(part->pairs);
+        free(part->others);
+        free(part->runs);
+        free(part->sorted);
+        if (part->merge_file)
+            fclose(part->merge_file);
         pthread_mutex_destroy(&part->lock);
     }
     
+    // 关闭即删除溢写文件
+    if (spill_files) {
+        for (int i = 0; i < num_mappers; i++)
+            if (spill_files[i].file)
+                fclose(spill_files[i].file);
+        free(spill_files);
+        spill_files = NULL;
+        spill_budget = 0;
+        options->spill_runs = spill_runs;
+    }
+    presort = 0;
+    
+    // key/value 字符串都在 arena 里，整块释放
+    for (int i = 0; i < num_mappers; i++)
+        arena_free(&arenas[i]);
+    free(arenas);
+    arenas = NULL;
+    arena_free(&shared_arena);
+    
     free(partitions);
     partitions = NULL;
     num_partitions = 0;
@@ -1,15 +1,38 @@
 #ifndef __mapreduce_h__
 #define __mapreduce_h__
 
+#include <stddef.h>
+
 // Different function pointer types used by MR
+//
+// The keys and values that getters hand to a Reducer or Combiner belong to
+// the library and must not be modified: equal short values are stored
+// once and shared by every pair that emitted them, so writing through one
+// would change them all. Copy a value first if you need to edit it.
 typedef char *(*Getter)(char *key, int partition_number);
 typedef void (*Mapper)(char *file_name);
+// A piece of file_name: the bytes [offset, offset + length), mapped at
+// 'data' (not NUL-terminated). Pieces split the file at line boundaries.
+typedef void (*RangeMapper)(char *file_name, char *data, size_t offset, size_t length);
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
+typedef char *(*CombineGetter)(char *key);
+typedef void (*Combiner)(char *key, CombineGetter get_next);
 
 // External functions: these are what you must define
 void MR_Emit(char *key, char *value);
 
+// Emit a pair straight to the reducers, bypassing the combiner
+// (this is how a Combiner passes on its combined values)
+void MR_EmitToReducer(char *key, char *value);
+
+// Batch alternatives to the Getter, for use inside a Reducer:
+// copy up to max_values of the values not yet returned for 'key' into
+// 'values' and return how many (0 once they are all gone) ...
+int MR_GetValues(char *key, int partition_number, char **values, int max_values);
+// ... or just count them, without taking them
+int MR_ValuesLeft(char *key, int partition_number);
+
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
 
 void MR_Run(int argc, char *argv[], 
@@ -17,4 +40,40 @@ void MR_Run(int argc, char *argv[],
 	    Reducer reduce, int num_reducers, 
 	    Partitioner partition);
 
+// Same, but the values each mapper emits for a key are first handed to
+// 'combine' (from within that mapper's thread), which MR_EmitToReducer()s
+// what the reducers should see instead
+void MR_RunWithCombiner(int argc, char *argv[],
+	    Mapper map, int num_mappers,
+	    Combiner combine,
+	    Reducer reduce, int num_reducers,
+	    Partitioner partition);
+
+#define MR_DEFAULT_SPLIT_SIZE (64 << 20)
+
+// All the knobs, for MR_RunWithOptions(). Zero fields take defaults.
+typedef struct {
+    Mapper map;             // whole files, one call each ...
+    RangeMapper map_range;  // ... or, if set, split_size pieces of them
+    size_t split_size;      // default MR_DEFAULT_SPLIT_SIZE
+    int num_mappers;
+    Combiner combine;       // optional
+    Reducer reduce;
+    int num_reducers;       // reducer threads
+    Partitioner partition;
+    int num_partitions;     // default: num_reducers. More partitions than
+                            // reducers spread skewed keys: each reducer
+                            // takes the largest partition left, until none are
+    size_t memory_budget;   // bytes of emitted pairs to hold in memory
+                            // (0: no limit; at least 64 KB per mapper).
+                            // Past it, mappers spill sorted runs to $TMPDIR
+                            // and reducers merge them back, 16 at a time.
+    int presort;            // mappers sort their own output as they finish
+                            // (while slower mappers still run); reducers
+                            // then merge those runs instead of sorting
+    long spill_runs;        // out: sorted runs written to disk
+} MR_Options;
+
+void MR_RunWithOptions(int argc, char *argv[], MR_Options *options);
+
 #endif // __mapreduce_h__
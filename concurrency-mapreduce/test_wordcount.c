@@ -22,20 +22,96 @@ void Map(char *file_name) {
     fclose(fp);
 }
 
+// Same, for one newline-aligned piece of a file
+void MapRange(char *file_name, char *data, size_t offset, size_t length) {
+    char word[256];
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && strchr(" \t\n\r", data[i]))
+            i++;
+        size_t start = i;
+        while (i < length && !strchr(" \t\n\r", data[i]))
+            i++;
+        size_t len = i - start;
+        if (len == 0)
+            continue;
+        // long words get a heap copy (MR_Emit copies the key itself)
+        char *key = len < sizeof(word) ? word : malloc(len + 1);
+        assert(key != NULL);
+        memcpy(key, data + start, len);
+        key[len] = '\0';
+        MR_Emit(key, "1");
+        if (key != word)
+            free(key);
+    }
+}
+
+// Sums up one mapper's counts for a word before they are shuffled
+void Combine(char *key, CombineGetter get_next) {
+    int count = 0;
+    char *value, buf[32];
+    while ((value = get_next(key)) != NULL)
+        count += atoi(value);
+    snprintf(buf, sizeof(buf), "%d", count);
+    MR_EmitToReducer(key, buf);
+}
+
 void Reduce(char *key, Getter get_next, int partition_number) {
     int count = 0;
     char *value;
     while ((value = get_next(key, partition_number)) != NULL)
-        count++;
+        count += atoi(value);
     printf("%s %d\n", key, count);
 }
 
 int main(int argc, char *argv[]) {
+    // -c: combine counts in the mappers
+    // -r: map small byte ranges of the files
+    // -s: spill to disk with the smallest memory budget (and fail if
+    //     nothing was spilled)
+    // -p: sort in the mappers, merge in the reducers
+    int combine = 0, ranges = 0, spill = 0, presort = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-c") == 0)
+            combine = 1;
+        else if (strcmp(argv[1], "-r") == 0)
+            ranges = 1;
+        else if (strcmp(argv[1], "-s") == 0)
+            spill = 1;
+        else if (strcmp(argv[1], "-p") == 0)
+            presort = 1;
+        else
+            break;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s file1 file2 ...\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-c] [-r] [-s] [-p] file1 file2 ...\n", argv[0]);
         return 1;
     }
-    MR_Run(argc, argv, Map, 2, Reduce, 2, MR_DefaultHashPartition);
+    if (ranges || spill || presort) {
+        MR_Options options = {
+            .map = Map,
+            .map_range = ranges ? MapRange : NULL,
+            .split_size = 4,
+            .memory_budget = spill ? 1 : 0,
+            .presort = presort,
+            .num_mappers = 2,
+            .combine = combine ? Combine : NULL,
+            .reduce = Reduce,
+            .num_reducers = 2,
+            .partition = MR_DefaultHashPartition
+        };
+        MR_RunWithOptions(argc, argv, &options);
+        if (spill && options.spill_runs == 0) {
+            fprintf(stderr, "%s: -s did not spill anything\n", argv[0]);
+            return 1;
+        }
+    } else if (combine)
+        MR_RunWithCombiner(argc, argv, Map, 2, Combine, Reduce, 2,
+                           MR_DefaultHashPartition);
+    else
+        MR_Run(argc, argv, Map, 2, Reduce, 2, MR_DefaultHashPartition);
     return 0;
 }
-
@@ -0,0 +1,63 @@
+#!/bin/bash
+# psort 基准测试：对每种 key 分布生成输入，在不同线程数和排序引擎下运行
+# psort -v，打印各阶段耗时、总耗时、吞吐量，并检查输出
+#
+# 用法: ./bench.sh [记录数]
+# 环境变量:
+#   THREADS     要测的线程数（默认 "1 2 4 ... 核心数"）
+#   DISTS       要测的分布（默认全部）
+#   ENGINES     merge（默认引擎）、sample（-s）、external（-m $BUDGET_MB）
+#   BUDGET_MB   external 的内存预算（默认是输入大小的四分之一）
+#   BENCH_DIR   输入输出文件放在哪里（默认 /tmp）
+
+RECORDS=${1:-1000000}
+DISTS=${DISTS:-"uniform sorted reverse dup skew"}
+ENGINES=${ENGINES:-"merge sample external"}
+BENCH_DIR=${BENCH_DIR:-/tmp}
+BUDGET_MB=${BUDGET_MB:-$(( RECORDS * 100 / 4 / 1048576 + 1 ))}
+if [ -z "$THREADS" ]; then
+    THREADS=1
+    t=2
+    while [ $t -lt $(nproc) ]; do
+        THREADS="$THREADS $t"
+        t=$(( t * 2 ))
+    done
+    [ $(nproc) -gt 1 ] && THREADS="$THREADS $(nproc)"
+fi
+
+cd "$(dirname "$0")"
+INPUT=$BENCH_DIR/psort_bench_in.dat
+OUTPUT=$BENCH_DIR/psort_bench_out.dat
+LOG=$BENCH_DIR/psort_bench.log
+BYTES=$(( RECORDS * 100 ))
+status=0
+
+printf "%-8s %-8s %4s %9s %8s  %-6s %s\n" 分布 引擎 线程 总耗时 GB/s 检查 各阶段
+for dist in $DISTS; do
+    ./gensort -d $dist $RECORDS $INPUT || exit 1
+    for engine in $ENGINES; do
+        case $engine in
+        merge) flags="" ;;
+        sample) flags="-s" ;;
+        external) flags="-m $BUDGET_MB" ;;
+        *) echo "未知的引擎: $engine"; exit 1 ;;
+        esac
+        for t in $THREADS; do
+            start=$(date +%s%N)
+            ./psort -v -t $t $flags $INPUT $OUTPUT 2> $LOG || { cat $LOG; exit 1; }
+            end=$(date +%s%N)
+            if ./gensort -c $INPUT $OUTPUT > /dev/null; then
+                ok=ok
+            else
+                ok=FAIL
+                status=1
+            fi
+            phases=$(awk '$1 == "阶段" { printf "%s=%s ", $2, $3 }' $LOG)
+            awk -v d=$dist -v e=$engine -v t=$t -v ns=$(( end - start )) -v b=$BYTES \
+                -v ok=$ok -v p="$phases" \
+                'BEGIN { s = ns / 1e9; printf "%-8s %-8s %4d %8.3fs %8.3f  %-6s %s\n", d, e, t, s, b / s / 1e9, ok, p }'
+        done
+    done
+done
+rm -f $INPUT $OUTPUT $LOG
+exit $status
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+// psort 的测试工具：
+//   gensort [-d 分布] [-r 种子] 记录数 output   生成 100 字节的记录
+//   gensort -c input output                      检查 output 是 input 排好序的结果
+//
+// 分布（决定前4字节 key，后96字节是随机数据）：
+//   uniform  均匀随机（默认）
+//   sorted   已经有序
+//   reverse  逆序
+//   dup      只有 16 种不同的 key
+//   skew     九成记录的首字节都是 0
+
+#define RECORD_SIZE 100
+#define KEY_SIZE 4
+#define WRITE_RECORDS 10000     // 每次写出这么多条
+
+static unsigned long rng_state = 88172645463325252UL;
+
+// xorshift64
+static unsigned long next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static unsigned int make_key(const char *dist, long i, long n) {
+    if (strcmp(dist, "sorted") == 0)
+        return (unsigned int)(0xFFFFFFFFUL * i / n);
+    if (strcmp(dist, "reverse") == 0)
+        return (unsigned int)(0xFFFFFFFFUL * (n - 1 - i) / n);
+    if (strcmp(dist, "dup") == 0)
+        return (unsigned int)(next_random() % 16) * 0x10000001U;
+    if (strcmp(dist, "skew") == 0) {
+        unsigned int key = next_random();
+        return next_random() % 10 == 0 ? key : key & 0x00FFFFFF;
+    }
+    return next_random();
+}
+
+static int generate(const char *dist, long n, const char *output_file) {
+    if (strcmp(dist, "uniform") && strcmp(dist, "sorted") && strcmp(dist, "reverse") &&
+        strcmp(dist, "dup") && strcmp(dist, "skew")) {
+        fprintf(stderr, "未知的分布: %s\n", dist);
+        return 1;
+    }
+    FILE *fp = fopen(output_file, "wb");
+    if (!fp) {
+        perror("无法打开输出文件");
+        return 1;
+    }
+    unsigned char *buf = malloc(WRITE_RECORDS * RECORD_SIZE);
+    if (!buf) {
+        perror("内存分配失败");
+        return 1;
+    }
+    for (long i = 0; i < n;) {
+        int count = 0;
+        for (; count < WRITE_RECORDS && i < n; count++, i++) {
+            unsigned char *rec = buf + count * RECORD_SIZE;
+            unsigned int key = make_key(dist, i, n);
+            rec[0] = key >> 24;
+            rec[1] = key >> 16;
+            rec[2] = key >> 8;
+            rec[3] = key;
+            for (int j = KEY_SIZE; j < RECORD_SIZE; j += 8) {
+                unsigned long r = next_random();
+                memcpy(rec + j, &r, RECORD_SIZE - j < 8 ? RECORD_SIZE - j : 8);
+            }
+        }
+        if (fwrite(buf, RECORD_SIZE, count, fp) != count) {
+            perror("写入文件失败");
+            return 1;
+        }
+    }
+    free(buf);
+    if (fclose(fp) != 0) {
+        perror("写入文件失败");
+        return 1;
+    }
+    return 0;
+}
+
+static unsigned char *map_file(const char *file, size_t *size) {
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(file);
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+    unsigned char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap失败");
+        exit(1);
+    }
+    close(fd);
+    return data;
+}
+
+// FNV-1a；对所有记录求和与异或，与记录的顺序无关
+static unsigned long record_hash(const unsigned char *rec) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < RECORD_SIZE; i++)
+        h = (h ^ rec[i]) * 1099511628211UL;
+    return h;
+}
+
+static int check(const char *input_file, const char *output_file) {
+    size_t in_size, out_size;
+    unsigned char *in = map_file(input_file, &in_size);
+    unsigned char *out = map_file(output_file, &out_size);
+    long n = in_size / RECORD_SIZE;
+    if (out_size != n * RECORD_SIZE) {
+        printf("错误: 输出 %zu 字节，应为 %ld 字节\n", out_size, n * RECORD_SIZE);
+        return 1;
+    }
+    unsigned long in_sum = 0, in_xor = 0, out_sum = 0, out_xor = 0;
+    for (long i = 0; i < n; i++) {
+        unsigned long h = record_hash(in + i * RECORD_SIZE);
+        in_sum += h;
+        in_xor ^= h;
+        h = record_hash(out + i * RECORD_SIZE);
+        out_sum += h;
+        out_xor ^= h;
+        if (i > 0 && memcmp(out + (i - 1) * RECORD_SIZE, out + i * RECORD_SIZE, KEY_SIZE) > 0) {
+            printf("错误: 记录 %ld 的key小于前一条记录\n", i);
+            return 1;
+        }
+    }
+    if (in_sum != out_sum || in_xor != out_xor) {
+        printf("错误: 输出不是输入记录的一个排列\n");
+        return 1;
+    }
+    printf("验证通过: %ld 条记录已正确排序\n", n);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dist = "uniform";
+    int check_mode = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:r:c")) != -1) {
+        switch (opt) {
+        case 'd':
+            dist = optarg;
+            break;
+        case 'r':
+            rng_state = strtoul(optarg, NULL, 0) | 1;
+            break;
+        case 'c':
+            check_mode = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2)
+        goto usage;
+    if (check_mode)
+        return check(argv[optind], argv[optind + 1]);
+    return generate(dist, atol(argv[optind]), argv[optind + 1]);
+    
+usage:
+    fprintf(stderr, "用法: %s [-d uniform|sorted|reverse|dup|skew] [-r seed] 记录数 output\n"
+                    "      %s -c input output\n", argv[0], argv[0]);
+    return 1;
+}
@@ -6,80 +6,880 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <limits.h>
+#include <time.h>
 
 #define RECORD_SIZE 100
 #define KEY_SIZE 4
 
+// 排序用的标签：key 和记录在输入中的下标，只有 8 字节。排序和归并只搬动
+// 标签，100 字节的记录最后按标签顺序一次性搬进输出
 typedef struct {
-    unsigned char *start;
+    unsigned int key;
+    unsigned int index;
+} Tag;
+
+typedef struct {
+    unsigned char *input;   // 整个输入
+    int first;              // 本块第一条记录的下标
     int num_records;
+    Tag *tags;              // 本块的标签，排好序后留在这里
+    Tag *aux;               // 同样大小的临时空间
     int thread_id;
 } SortArgs;
 
-// 比较函数：比较两条记录的前4字节key
-static int compare_records(const void *a, const void *b) {
-    const unsigned char *rec_a = (const unsigned char *)a;
-    const unsigned char *rec_b = (const unsigned char *)b;
-    
-    // 比较前4字节（key）
-    for (int i = 0; i < KEY_SIZE; i++) {
-        if (rec_a[i] != rec_b[i]) {
-            return rec_a[i] - rec_b[i];
-        }
+// -v：每个阶段结束时把它的耗时打到 stderr（"阶段 <名字> <秒>"，供 bench.sh 解析）
+static int verbose = 0;
+static double phase_start;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void phase_done(const char *name) {
+    double now = now_seconds();
+    if (verbose)
+        fprintf(stderr, "阶段 %s %.4f\n", name, now - phase_start);
+    phase_start = now;
+}
+
+// 记录的 key 按大端解释成整数，整数顺序就是前4字节的字节序
+static unsigned int record_key(const unsigned char *rec) {
+    return ((unsigned int)rec[0] << 24) | ((unsigned int)rec[1] << 16) |
+           ((unsigned int)rec[2] << 8) | rec[3];
+}
+
+// 取出输入中 [first, first + n) 这些记录的标签
+static void extract_tags(unsigned char *input, int first, int n, Tag *tags) {
+    for (int i = 0; i < n; i++) {
+        tags[i].key = record_key(input + (long)(first + i) * RECORD_SIZE);
+        tags[i].index = first + i;
     }
-    return 0;
 }
 
-// 线程排序函数：对指定范围的记录进行排序
+// 按 key 对标签做 LSD 基数排序（每趟 8 位，所有标签该字节都相同的趟直接
+// 跳过），aux 是同样大小的临时空间；返回排好序的那一份（tags 或 aux）
+static Tag *radix_sort_tags(Tag *tags, Tag *aux, int n) {
+    if (n < 2)
+        return tags;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; i++)
+            count[((tags[i].key >> shift) & 0xff) + 1]++;
+        if (count[((tags[0].key >> shift) & 0xff) + 1] == n)
+            continue;  // 这一字节全都一样
+        for (int b = 0; b < 256; b++)
+            count[b + 1] += count[b];
+        for (int i = 0; i < n; i++)
+            aux[count[(tags[i].key >> shift) & 0xff]++] = tags[i];
+        Tag *tmp = tags;
+        tags = aux;
+        aux = tmp;
+    }
+    return tags;
+}
+
+// 按标签顺序把记录搬进 out
+static void gather_records(unsigned char *input, Tag *tags, int n, unsigned char *out) {
+    for (int i = 0; i < n; i++)
+        memcpy(out + (long)i * RECORD_SIZE, input + (long)tags[i].index * RECORD_SIZE,
+               RECORD_SIZE);
+}
+
+// 线程排序函数：取出本块的标签并排序
 void *sort_chunk(void *arg) {
     SortArgs *args = (SortArgs *)arg;
-    qsort(args->start, args->num_records, RECORD_SIZE, compare_records);
+    extract_tags(args->input, args->first, args->num_records, args->tags);
+    Tag *sorted = radix_sort_tags(args->tags, args->aux, args->num_records);
+    if (sorted != args->tags)
+        memcpy(args->tags, sorted, args->num_records * sizeof(Tag));
+    return NULL;
+}
+
+// 有序块中第一个 key > v 的位置
+static int upper_bound(const Tag *chunk, int num, unsigned int v) {
+    int lo = 0, hi = num;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (chunk[mid].key <= v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// 在所有块中找最小的 v，使 key <= v 的记录至少有 rank 条，
+// 把每个块中 key <= v 的记录数写进 split（rank 为 0 时不取任何记录）
+static void find_splits(Tag **chunks, int *sizes, int num_chunks,
+                        long rank, int *split) {
+    if (rank == 0) {
+        memset(split, 0, num_chunks * sizeof(int));
+        return;
+    }
+    unsigned long lo = 0, hi = 0xFFFFFFFFUL;
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        long count = 0;
+        for (int i = 0; i < num_chunks; i++)
+            count += upper_bound(chunks[i], sizes[i], mid);
+        if (count >= rank)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    for (int i = 0; i < num_chunks; i++)
+        split[i] = upper_bound(chunks[i], sizes[i], lo);
+}
+
+typedef struct {
+    unsigned char *input;
+    Tag **chunks;           // 各块排好序的标签
+    int num_chunks;
+    int *from;              // 每个块中本段的起点
+    int *to;                // 每个块中本段的终点
+    unsigned char *output;  // 本段在最终输出中的位置
+} MergeArgs;
+
+// 最小堆（按各块当前标签的 key）的下沉，heap 中是块编号
+static void heap_down(int *heap, int n, int i, Tag **chunks, int *pos) {
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && chunks[heap[l]][pos[heap[l]]].key < chunks[heap[smallest]][pos[heap[smallest]]].key)
+            smallest = l;
+        if (r < n && chunks[heap[r]][pos[heap[r]]].key < chunks[heap[smallest]][pos[heap[smallest]]].key)
+            smallest = r;
+        if (smallest == i)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// 线程归并函数：把各块标签的 [from, to) 做 k 路归并，按归并顺序把
+// 对应的记录直接写进最终输出（顺序写，只有读是随机的）
+void *merge_range(void *arg) {
+    MergeArgs *args = (MergeArgs *)arg;
+    int k = args->num_chunks;
+    Tag **chunks = args->chunks;
+    int *pos = malloc(k * sizeof(int));
+    int *heap = malloc(k * sizeof(int));
+    if (!pos || !heap) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    
+    int n = 0;
+    for (int i = 0; i < k; i++) {
+        pos[i] = args->from[i];
+        if (pos[i] < args->to[i])
+            heap[n++] = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        heap_down(heap, n, i, chunks, pos);
+    
+    unsigned char *out = args->output;
+    while (n > 0) {
+        int c = heap[0];
+        memcpy(out, args->input + (long)chunks[c][pos[c]].index * RECORD_SIZE, RECORD_SIZE);
+        out += RECORD_SIZE;
+        if (++pos[c] == args->to[c])
+            heap[0] = heap[--n];
+        heap_down(heap, n, 0, chunks, pos);
+    }
+    
+    free(pos);
+    free(heap);
+    return NULL;
+}
+
+// 排序引擎一：各线程排序自己的块，再按输出区间并行归并
+static void merge_sort_records(unsigned char *input, int num_records, unsigned char *output,
+                               int num_threads, Tag *tags, Tag *aux) {
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    SortArgs *args = malloc(num_threads * sizeof(SortArgs));
+    if (!threads || !args) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    
+    // 计算每个线程处理的记录数
+    int records_per_thread = num_records / num_threads;
+    int remainder = num_records % num_threads;
+    
+    // 创建线程对各个块进行排序
+    int offset = 0;
+    for (int i = 0; i < num_threads; i++) {
+        int chunk_size = records_per_thread + (i < remainder ? 1 : 0);
+        args[i].input = input;
+        args[i].first = offset;
+        args[i].num_records = chunk_size;
+        args[i].tags = tags + offset;
+        args[i].aux = aux + offset;
+        args[i].thread_id = i;
+        
+        pthread_create(&threads[i], NULL, sort_chunk, &args[i]);
+        offset += chunk_size;
+    }
+    
+    // 等待所有线程完成
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    phase_done("排序");
+    
+    // 并行归并：把输出按记录数切成 num_threads 段，在每个块中找出各段的
+    // 分界（key 不超过分界值的记录在前），每个线程把自己那段直接归并进输出
+    Tag **chunks = malloc(num_threads * sizeof(Tag *));
+    int *sizes = malloc(num_threads * sizeof(int));
+    int *splits = malloc((num_threads + 1) * num_threads * sizeof(int));
+    MergeArgs *merge_args = malloc(num_threads * sizeof(MergeArgs));
+    if (!chunks || !sizes || !splits || !merge_args) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        chunks[i] = args[i].tags;
+        sizes[i] = args[i].num_records;
+    }
+    for (int t = 0; t < num_threads; t++)
+        find_splits(chunks, sizes, num_threads, (long)num_records * t / num_threads,
+                    splits + t * num_threads);
+    memcpy(splits + num_threads * num_threads, sizes, num_threads * sizeof(int));
+    
+    for (int t = 0; t < num_threads; t++) {
+        int *from = splits + t * num_threads;
+        int *to = from + num_threads;
+        long out_offset = 0;
+        for (int i = 0; i < num_threads; i++)
+            out_offset += from[i];
+        merge_args[t].input = input;
+        merge_args[t].chunks = chunks;
+        merge_args[t].num_chunks = num_threads;
+        merge_args[t].from = from;
+        merge_args[t].to = to;
+        merge_args[t].output = output + out_offset * RECORD_SIZE;
+        pthread_create(&threads[t], NULL, merge_range, &merge_args[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    phase_done("归并");
+    free(chunks);
+    free(sizes);
+    free(splits);
+    free(merge_args);
+    free(threads);
+    free(args);
+}
+
+#define SAMPLES_PER_BUCKET 64
+
+typedef struct {
+    unsigned char *input;
+    int first;                  // 本线程的输入块 [first, first + num_records)
+    int num_records;
+    Tag *tags;                  // 本块的标签
+    unsigned int *splitters;    // 桶 b 装 key 在 [splitters[b-1], splitters[b]) 的记录
+    int num_buckets;
+    int *pos;                   // 本块落进各桶的标签数，之后变成各桶的写入位置
+    Tag *buckets;               // 所有桶首尾相接
+    int bucket_start;           // 最后一步本线程负责的桶
+    int bucket_size;
+    Tag *scratch;               // 基数排序的临时空间，与 buckets 对应
+    unsigned char *output;
+} SampleArgs;
+
+// key 落进哪个桶：不超过 key 的分界值个数
+static int bucket_of(unsigned int *splitters, int num_splitters, unsigned int key) {
+    int lo = 0, hi = num_splitters;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (splitters[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    unsigned int key_a = *(const unsigned int *)a;
+    unsigned int key_b = *(const unsigned int *)b;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+// 第一步：取出本块的标签，统计各桶的个数
+void *sample_count(void *arg) {
+    SampleArgs *args = (SampleArgs *)arg;
+    extract_tags(args->input, args->first, args->num_records, args->tags);
+    memset(args->pos, 0, args->num_buckets * sizeof(int));
+    for (int i = 0; i < args->num_records; i++)
+        args->pos[bucket_of(args->splitters, args->num_buckets - 1, args->tags[i].key)]++;
     return NULL;
 }
 
-// 归并两个已排序的块
-void merge_chunks(unsigned char *chunk1, int num1, 
-                  unsigned char *chunk2, int num2, 
-                  unsigned char *output) {
-    int i = 0, j = 0, k = 0;
-    
-    while (i < num1 && j < num2) {
-        if (compare_records(chunk1 + i * RECORD_SIZE, 
-                           chunk2 + j * RECORD_SIZE) <= 0) {
-            memcpy(output + k * RECORD_SIZE, 
-                   chunk1 + i * RECORD_SIZE, RECORD_SIZE);
-            i++;
-        } else {
-            memcpy(output + k * RECORD_SIZE, 
-                   chunk2 + j * RECORD_SIZE, RECORD_SIZE);
-            j++;
+// 第二步：把本块的标签分散进各桶中属于本线程的区域
+void *sample_scatter(void *arg) {
+    SampleArgs *args = (SampleArgs *)arg;
+    for (int i = 0; i < args->num_records; i++) {
+        Tag t = args->tags[i];
+        args->buckets[args->pos[bucket_of(args->splitters, args->num_buckets - 1, t.key)]++] = t;
+    }
+    return NULL;
+}
+
+// 第三步：排序一个桶，把它的记录直接写到输出中的最终位置
+void *sample_sort_bucket(void *arg) {
+    SampleArgs *args = (SampleArgs *)arg;
+    Tag *bucket = args->buckets + args->bucket_start;
+    Tag *sorted = radix_sort_tags(bucket, args->scratch + args->bucket_start, args->bucket_size);
+    gather_records(args->input, sorted, args->bucket_size,
+                   args->output + (long)args->bucket_start * RECORD_SIZE);
+    return NULL;
+}
+
+// 排序引擎二：样本排序。由抽样选出 num_threads - 1 个分界值，各线程把
+// 自己块中的记录按分界分进桶，再各自排好一个桶；桶之间已经有序，不用归并
+static void sample_sort_records(unsigned char *input, int num_records, unsigned char *output,
+                                int num_threads, Tag *tags, Tag *aux) {
+    int num_buckets = num_threads;
+    int num_samples = num_buckets * SAMPLES_PER_BUCKET;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    SampleArgs *args = malloc(num_threads * sizeof(SampleArgs));
+    unsigned int *samples = malloc(num_samples * sizeof(unsigned int));
+    int *pos = malloc(num_threads * num_buckets * sizeof(int));
+    if (!threads || !args || !samples || !pos) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    
+    // 等距抽样，排序后取分位点作分界
+    for (int i = 0; i < num_samples; i++)
+        samples[i] = record_key(input + (long)num_records * i / num_samples * RECORD_SIZE);
+    qsort(samples, num_samples, sizeof(unsigned int), compare_keys);
+    unsigned int *splitters = samples;
+    for (int b = 1; b < num_buckets; b++)
+        splitters[b - 1] = samples[b * SAMPLES_PER_BUCKET];
+    
+    int records_per_thread = num_records / num_threads;
+    int remainder = num_records % num_threads;
+    int offset = 0;
+    for (int i = 0; i < num_threads; i++) {
+        int chunk_size = records_per_thread + (i < remainder ? 1 : 0);
+        args[i].input = input;
+        args[i].first = offset;
+        args[i].num_records = chunk_size;
+        args[i].tags = tags + offset;
+        args[i].splitters = splitters;
+        args[i].num_buckets = num_buckets;
+        args[i].pos = pos + i * num_buckets;
+        args[i].buckets = aux;
+        args[i].scratch = tags;
+        args[i].output = output;
+        pthread_create(&threads[i], NULL, sample_count, &args[i]);
+        offset += chunk_size;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    phase_done("统计");
+    
+    // 桶按顺序排列；每个桶里，线程 i 的区域紧跟在线程 i-1 之后
+    offset = 0;
+    for (int b = 0; b < num_buckets; b++) {
+        args[b].bucket_start = offset;
+        for (int i = 0; i < num_threads; i++) {
+            int count = pos[i * num_buckets + b];
+            pos[i * num_buckets + b] = offset;
+            offset += count;
         }
-        k++;
+        args[b].bucket_size = offset - args[b].bucket_start;
     }
     
-    // 复制剩余记录
-    while (i < num1) {
-        memcpy(output + k * RECORD_SIZE, 
-               chunk1 + i * RECORD_SIZE, RECORD_SIZE);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, sample_scatter, &args[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    phase_done("分桶");
+    
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, sample_sort_bucket, &args[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    phase_done("排序");
+    
+    free(threads);
+    free(args);
+    free(samples);
+    free(pos);
+}
+
+// ========== 外部排序（-m）：输入比内存预算大时 ==========
+// 先把输入按预算切成若干段，每段读进内存用上面的引擎排好，作为一个 run
+// 写进临时文件；再按 key 把输出切成若干段，每个线程对所有 run 中
+// 属于自己那段的部分做流式 k 路归并，大块顺序读写，直接 pwrite 到输出。
+// 每路缓冲区不能小于 MIN_MERGE_BUFFER，所以预算放不下所有 run 的缓冲区时，
+// 先少开几个归并线程，还不够就多趟归并：每次把一组 run 归并成一个
+
+#define RUN_INDEX_STRIDE 1024           // run 中每隔这么多条记录在内存里记一个 key
+#define MIN_MERGE_BUFFER (64 * 1024)    // 归并时每路缓冲区至少这么大
+#define MIN_MERGE_FAN_IN 8              // 减少归并线程，让每个线程至少能读这么多路
+
+typedef struct {
+    off_t offset;           // run 在临时文件中的起点（字节）
+    long num_records;
+    unsigned int *index;    // 第 i 个是第 i * RUN_INDEX_STRIDE 条记录的 key
+} Run;
+
+static void read_full(int fd, unsigned char *buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t rc = pread(fd, buf, n, offset);
+        if (rc <= 0) {
+            perror("读取失败");
+            exit(1);
+        }
+        buf += rc;
+        n -= rc;
+        offset += rc;
+    }
+}
+
+static void write_full(int fd, const unsigned char *buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t rc = pwrite(fd, buf, n, offset);
+        if (rc < 0) {
+            perror("写入文件失败");
+            exit(1);
+        }
+        buf += rc;
+        n -= rc;
+        offset += rc;
+    }
+}
+
+// 临时文件放在 $TMPDIR（默认 /tmp），创建后立即删除，关闭时自动回收
+static int open_temp_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/psort-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("无法创建临时文件");
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+// run 中第一条 key > v 的记录的位置：先用内存里的索引定位到块，再读这一块
+static long run_upper_bound(int fd, Run *run, unsigned int v, unsigned char *block) {
+    long num_index = (run->num_records + RUN_INDEX_STRIDE - 1) / RUN_INDEX_STRIDE;
+    long lo = 0, hi = num_index;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (run->index[mid] <= v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+    long first = (lo - 1) * RUN_INDEX_STRIDE;
+    long n = run->num_records - first;
+    if (n > RUN_INDEX_STRIDE)
+        n = RUN_INDEX_STRIDE;
+    read_full(fd, block, n * RECORD_SIZE, run->offset + first * RECORD_SIZE);
+    long i = 1;     // 第 0 条就是索引里的 key，已知 <= v
+    while (i < n && record_key(block + i * RECORD_SIZE) <= v)
         i++;
-        k++;
+    return first + i;
+}
+
+// 归并的一路输入：run 中 [next, end) 还没读，缓冲区里是 [pos, len)
+typedef struct {
+    unsigned char *buf;
+    int pos;
+    int len;
+    long next;
+    long end;
+    off_t base;             // run 的起点
+} RunReader;
+
+typedef struct {
+    int fd_tmp;
+    int fd_out;
+    Run *runs;
+    int num_runs;
+    long *from;             // 每个 run 中本段的起点（记录）
+    long *to;
+    off_t out_offset;       // 本段在输出文件中的位置（字节）
+    int buffer_records;     // 每路缓冲区能放的记录数
+    unsigned int *index;    // 不为 NULL 时顺便记下输出的 run 索引
+} ExternalMergeArgs;
+
+static int reader_fill(int fd, RunReader *r, int buffer_records) {
+    long n = r->end - r->next;
+    if (n == 0)
+        return 0;
+    if (n > buffer_records)
+        n = buffer_records;
+    read_full(fd, r->buf, n * RECORD_SIZE, r->base + r->next * RECORD_SIZE);
+    r->next += n;
+    r->pos = 0;
+    r->len = n;
+    return 1;
+}
+
+static unsigned int reader_key(RunReader *r) {
+    return record_key(r->buf + r->pos * RECORD_SIZE);
+}
+
+static void reader_heap_down(RunReader **heap, int n, int i) {
+    while (1) {
+        int smallest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && reader_key(heap[l]) < reader_key(heap[smallest]))
+            smallest = l;
+        if (r < n && reader_key(heap[r]) < reader_key(heap[smallest]))
+            smallest = r;
+        if (smallest == i)
+            return;
+        RunReader *tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// 线程归并函数：把所有 run 中本段的部分归并后顺序写到输出文件
+void *external_merge_range(void *arg) {
+    ExternalMergeArgs *args = (ExternalMergeArgs *)arg;
+    int k = args->num_runs;
+    size_t buffer_bytes = (size_t)args->buffer_records * RECORD_SIZE;
+    RunReader *readers = calloc(k, sizeof(RunReader));
+    RunReader **heap = malloc(k * sizeof(RunReader *));
+    unsigned char *out = malloc(buffer_bytes);
+    if (!readers || !heap || !out) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    
+    int n = 0;
+    for (int i = 0; i < k; i++) {
+        RunReader *r = &readers[i];
+        r->next = args->from[i];
+        r->end = args->to[i];
+        r->base = args->runs[i].offset;
+        if (r->next == r->end)
+            continue;
+        r->buf = malloc(buffer_bytes);
+        if (!r->buf) {
+            perror("内存分配失败");
+            exit(1);
+        }
+        reader_fill(args->fd_tmp, r, args->buffer_records);
+        heap[n++] = r;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        reader_heap_down(heap, n, i);
+    
+    off_t out_offset = args->out_offset;
+    int out_len = 0;
+    long written = 0;
+    while (n > 0) {
+        RunReader *r = heap[0];
+        if (args->index && written++ % RUN_INDEX_STRIDE == 0)
+            args->index[(written - 1) / RUN_INDEX_STRIDE] = reader_key(r);
+        memcpy(out + (size_t)out_len * RECORD_SIZE, r->buf + r->pos * RECORD_SIZE, RECORD_SIZE);
+        if (++out_len == args->buffer_records) {
+            write_full(args->fd_out, out, buffer_bytes, out_offset);
+            out_offset += buffer_bytes;
+            out_len = 0;
+        }
+        if (++r->pos == r->len && !reader_fill(args->fd_tmp, r, args->buffer_records))
+            heap[0] = heap[--n];
+        reader_heap_down(heap, n, 0);
+    }
+    write_full(args->fd_out, out, (size_t)out_len * RECORD_SIZE, out_offset);
+    
+    for (int i = 0; i < k; i++)
+        free(readers[i].buf);
+    free(readers);
+    free(heap);
+    free(out);
+    return NULL;
+}
+
+// 一趟中间归并：每 fan_in 个相邻的 run 归并成一个，写到 fd_next 中同样的
+// 位置（相邻 run 在文件里也相邻）。最多 threads 组同时归并。返回新的 run 数
+static int merge_pass(int fd_tmp, int fd_next, Run *runs, int num_runs, int fan_in,
+                      int threads, int buffer_records) {
+    int num_groups = (num_runs + fan_in - 1) / fan_in;
+    Run *merged = malloc(num_groups * sizeof(Run));
+    long *from = calloc(num_runs, sizeof(long));
+    long *to = malloc(num_runs * sizeof(long));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ExternalMergeArgs *args = malloc(threads * sizeof(ExternalMergeArgs));
+    if (!merged || !from || !to || !tids || !args) {
+        perror("内存分配失败");
+        exit(1);
     }
-    while (j < num2) {
-        memcpy(output + k * RECORD_SIZE, 
-               chunk2 + j * RECORD_SIZE, RECORD_SIZE);
-        j++;
-        k++;
+    for (int i = 0; i < num_runs; i++)
+        to[i] = runs[i].num_records;
+    
+    for (int g = 0; g < num_groups; g += threads) {
+        int batch = num_groups - g < threads ? num_groups - g : threads;
+        for (int b = 0; b < batch; b++) {
+            int first = (g + b) * fan_in;
+            int k = num_runs - first < fan_in ? num_runs - first : fan_in;
+            Run *run = &merged[g + b];
+            run->offset = runs[first].offset;
+            run->num_records = 0;
+            for (int i = first; i < first + k; i++)
+                run->num_records += runs[i].num_records;
+            run->index = malloc(((run->num_records + RUN_INDEX_STRIDE - 1) / RUN_INDEX_STRIDE) *
+                                sizeof(unsigned int));
+            if (!run->index) {
+                perror("内存分配失败");
+                exit(1);
+            }
+            args[b] = (ExternalMergeArgs) {
+                .fd_tmp = fd_tmp,
+                .fd_out = fd_next,
+                .runs = runs + first,
+                .num_runs = k,
+                .from = from + first,
+                .to = to + first,
+                .out_offset = run->offset,
+                .buffer_records = buffer_records,
+                .index = run->index
+            };
+            pthread_create(&tids[b], NULL, external_merge_range, &args[b]);
+        }
+        for (int b = 0; b < batch; b++)
+            pthread_join(tids[b], NULL);
     }
+    
+    for (int i = 0; i < num_runs; i++)
+        free(runs[i].index);
+    memcpy(runs, merged, num_groups * sizeof(Run));
+    free(merged);
+    free(from);
+    free(to);
+    free(tids);
+    free(args);
+    return num_groups;
+}
+
+static void external_sort(int fd_in, long num_records, int fd_out, size_t budget,
+                          int num_threads, int sample) {
+    // 排序一段需要：读进来的记录、排好的记录、两份标签
+    long run_records = budget / (2 * RECORD_SIZE + 2 * sizeof(Tag));
+    if (run_records < 1)
+        run_records = 1;
+    if (run_records > INT_MAX)
+        run_records = INT_MAX;
+    if (run_records > num_records)
+        run_records = num_records;
+    int num_runs = (num_records + run_records - 1) / run_records;
+    Run *runs = malloc(num_runs * sizeof(Run));
+    unsigned char *in_buf = malloc(run_records * RECORD_SIZE);
+    unsigned char *out_buf = malloc(run_records * RECORD_SIZE);
+    Tag *tags = malloc(run_records * sizeof(Tag));
+    Tag *aux = malloc(run_records * sizeof(Tag));
+    if (!runs || !in_buf || !out_buf || !tags || !aux) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    
+    // 第一步：生成有序的 run（各 run 内部的阶段不单独计时）
+    int fd_tmp = open_temp_file();
+    double runs_start = phase_start;
+    int saved_verbose = verbose;
+    verbose = 0;
+    for (int i = 0; i < num_runs; i++) {
+        Run *run = &runs[i];
+        long first = (long)i * run_records;
+        int n = num_records - first < run_records ? num_records - first : run_records;
+        int threads = num_threads < n ? num_threads : n;
+        read_full(fd_in, in_buf, (size_t)n * RECORD_SIZE, (off_t)first * RECORD_SIZE);
+        if (sample)
+            sample_sort_records(in_buf, n, out_buf, threads, tags, aux);
+        else
+            merge_sort_records(in_buf, n, out_buf, threads, tags, aux);
+        run->offset = (off_t)first * RECORD_SIZE;
+        run->num_records = n;
+        write_full(fd_tmp, out_buf, (size_t)n * RECORD_SIZE, run->offset);
+        
+        run->index = malloc(((n + RUN_INDEX_STRIDE - 1) / RUN_INDEX_STRIDE) * sizeof(unsigned int));
+        if (!run->index) {
+            perror("内存分配失败");
+            exit(1);
+        }
+        for (int j = 0; j < n; j += RUN_INDEX_STRIDE)
+            run->index[j / RUN_INDEX_STRIDE] = record_key(out_buf + (size_t)j * RECORD_SIZE);
+    }
+    free(in_buf);
+    free(out_buf);
+    free(tags);
+    free(aux);
+    verbose = saved_verbose;
+    phase_start = runs_start;
+    phase_done("生成run");
+    
+    // 第二步：每个归并线程要 (路数 + 1) 个缓冲区。预算不够每个线程读
+    // MIN_MERGE_FAN_IN 路时少开线程；run 比一个线程能读的路数还多时，
+    // 先一趟趟归并，直到一次能读完
+    size_t buffers = budget / MIN_MERGE_BUFFER;
+    if ((size_t)num_threads * (MIN_MERGE_FAN_IN + 1) > buffers) {
+        num_threads = buffers / (MIN_MERGE_FAN_IN + 1);
+        if (num_threads < 1)
+            num_threads = 1;
+    }
+    int max_fan_in = buffers / num_threads - 1;
+    if (max_fan_in < 2)
+        max_fan_in = 2;
+    if (num_runs > max_fan_in) {
+        int fd_next = open_temp_file();
+        int pass_buffer_records = MIN_MERGE_BUFFER / RECORD_SIZE;
+        while (num_runs > max_fan_in) {
+            num_runs = merge_pass(fd_tmp, fd_next, runs, num_runs, max_fan_in,
+                                  num_threads, pass_buffer_records);
+            int fd = fd_tmp;
+            fd_tmp = fd_next;
+            fd_next = fd;
+        }
+        close(fd_next);
+        phase_done("多趟归并");
+    }
+    
+    // 第三步：从所有 run 的索引 key 中取分位点作为各线程的分界
+    long num_samples = 0;
+    for (int i = 0; i < num_runs; i++)
+        num_samples += (runs[i].num_records + RUN_INDEX_STRIDE - 1) / RUN_INDEX_STRIDE;
+    unsigned int *samples = malloc(num_samples * sizeof(unsigned int));
+    long *bounds = malloc((num_threads + 1) * num_runs * sizeof(long));
+    unsigned char *block = malloc(RUN_INDEX_STRIDE * RECORD_SIZE);
+    if (!samples || !bounds || !block) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    num_samples = 0;
+    for (int i = 0; i < num_runs; i++)
+        for (long j = 0; j * RUN_INDEX_STRIDE < runs[i].num_records; j++)
+            samples[num_samples++] = runs[i].index[j];
+    qsort(samples, num_samples, sizeof(unsigned int), compare_keys);
+    
+    // bounds[t * num_runs + i]：run i 中属于线程 t 之前各段的记录数
+    for (int i = 0; i < num_runs; i++) {
+        bounds[i] = 0;
+        bounds[num_threads * num_runs + i] = runs[i].num_records;
+    }
+    for (int t = 1; t < num_threads; t++) {
+        unsigned int v = samples[num_samples * t / num_threads];
+        for (int i = 0; i < num_runs; i++)
+            bounds[t * num_runs + i] = run_upper_bound(fd_tmp, &runs[i], v, block);
+    }
+    // v 不会变小，但保险起见让分界单调
+    for (int t = 1; t <= num_threads; t++)
+        for (int i = 0; i < num_runs; i++)
+            if (bounds[t * num_runs + i] < bounds[(t - 1) * num_runs + i])
+                bounds[t * num_runs + i] = bounds[(t - 1) * num_runs + i];
+    free(samples);
+    free(block);
+    phase_done("分界");
+    
+    // 第四步：并行归并。预算平分给所有线程的所有读缓冲区和写缓冲区
+    size_t buffer_bytes = budget / ((size_t)num_threads * (num_runs + 1));
+    if (buffer_bytes < MIN_MERGE_BUFFER)
+        buffer_bytes = MIN_MERGE_BUFFER;
+    int buffer_records = buffer_bytes / RECORD_SIZE;
+    if (ftruncate(fd_out, (off_t)num_records * RECORD_SIZE) < 0) {
+        perror("无法设置输出文件大小");
+        exit(1);
+    }
+    
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    ExternalMergeArgs *args = malloc(num_threads * sizeof(ExternalMergeArgs));
+    if (!threads || !args) {
+        perror("内存分配失败");
+        exit(1);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        long *from = bounds + t * num_runs;
+        long out_records = 0;
+        for (int i = 0; i < num_runs; i++)
+            out_records += from[i];
+        args[t] = (ExternalMergeArgs) {
+            .fd_tmp = fd_tmp,
+            .fd_out = fd_out,
+            .runs = runs,
+            .num_runs = num_runs,
+            .from = from,
+            .to = from + num_runs,
+            .out_offset = (off_t)out_records * RECORD_SIZE,
+            .buffer_records = buffer_records
+        };
+        pthread_create(&threads[t], NULL, external_merge_range, &args[t]);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    phase_done("外部归并");
+    
+    close(fd_tmp);
+    for (int i = 0; i < num_runs; i++)
+        free(runs[i].index);
+    free(runs);
+    free(bounds);
+    free(threads);
+    free(args);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "用法: %s input output\n", argv[0]);
+    // -s: 用样本排序引擎（默认是排序后并行归并）
+    // -m MB: 内存预算，输入放不下时做外部排序
+    // -t N: 线程数（默认是CPU核心数）
+    // -v: 打印各阶段耗时
+    int sample = 0;
+    size_t budget = 0;
+    int num_threads = 0;
+    int opt;
+    phase_start = now_seconds();
+    while ((opt = getopt(argc, argv, "sm:t:v")) != -1) {
+        switch (opt) {
+        case 's':
+            sample = 1;
+            break;
+        case 'm':
+            budget = (size_t)atol(optarg) << 20;
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "用法: %s [-s] [-m MB] [-t threads] [-v] input output\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "用法: %s [-s] [-m MB] [-t threads] [-v] input output\n", argv[0]);
         exit(1);
     }
     
-    const char *input_file = argv[1];
-    const char *output_file = argv[2];
+    const char *input_file = argv[optind];
+    const char *output_file = argv[optind + 1];
     
     // 打开输入文件
     int fd_in = open(input_file, O_RDONLY);
@@ -96,139 +896,101 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
-    int file_size = st.st_size;
-    int num_records = file_size / RECORD_SIZE;
+    off_t file_size = st.st_size;
+    long num_records = file_size / RECORD_SIZE;
     
     if (file_size % RECORD_SIZE != 0) {
         fprintf(stderr, "警告: 文件大小不是100字节的倍数\n");
     }
     
-    // 使用mmap映射输入文件（MAP_PRIVATE确保修改不会写回文件）
-    unsigned char *input_data = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_in, 0);
-    if (input_data == MAP_FAILED) {
-        perror("mmap失败");
-        close(fd_in);
-        exit(1);
-    }
-    close(fd_in);
-    
     // 获取CPU核心数
-    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1)
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     if (num_threads < 1) num_threads = 1;
     if (num_threads > num_records) num_threads = num_records;
     
-    // 分配输出缓冲区
-    unsigned char *output_data = malloc(file_size);
-    if (!output_data) {
-        perror("内存分配失败");
-        munmap(input_data, file_size);
+    // 输出文件要能 mmap 成可写的共享映射，所以用 O_RDWR 打开
+    int fd_out = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_out < 0) {
+        perror("无法打开输出文件");
         exit(1);
     }
     
-    // 分配临时缓冲区用于归并
-    unsigned char *temp_buffer = malloc(file_size);
-    if (!temp_buffer) {
-        perror("内存分配失败");
-        free(output_data);
-        munmap(input_data, file_size);
-        exit(1);
+    // 内存里要放输入、输出和标签，超出预算就走外部排序
+    if (budget > 0 && num_records > 0 &&
+        (size_t)num_records * (2 * RECORD_SIZE + 2 * sizeof(Tag)) > budget) {
+        external_sort(fd_in, num_records, fd_out, budget, num_threads, sample);
+        close(fd_in);
+        if (fsync(fd_out) < 0) {
+            perror("fsync失败");
+        }
+        close(fd_out);
+        phase_done("fsync");
+        return 0;
     }
-    
-    // 创建线程和参数数组
-    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
-    SortArgs *args = malloc(num_threads * sizeof(SortArgs));
-    
-    if (!threads || !args) {
-        perror("内存分配失败");
-        free(output_data);
-        free(temp_buffer);
-        munmap(input_data, file_size);
+    if (num_records > INT_MAX) {
+        fprintf(stderr, "输入太大，请用 -m 指定内存预算做外部排序\n");
         exit(1);
     }
-    
-    // 计算每个线程处理的记录数
-    int records_per_thread = num_records / num_threads;
-    int remainder = num_records % num_threads;
-    
-    // 创建线程对各个块进行排序
-    int offset = 0;
-    for (int i = 0; i < num_threads; i++) {
-        int chunk_size = records_per_thread + (i < remainder ? 1 : 0);
-        args[i].start = input_data + offset * RECORD_SIZE;
-        args[i].num_records = chunk_size;
-        args[i].thread_id = i;
-        
-        pthread_create(&threads[i], NULL, sort_chunk, &args[i]);
-        offset += chunk_size;
+    if (num_records == 0) {
+        close(fd_in);
+        close(fd_out);
+        return 0;
     }
     
-    // 等待所有线程完成
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    // 使用mmap映射输入文件（只读：排序的是标签，记录本身不动）
+    unsigned char *input_data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd_in, 0);
+    if (input_data == MAP_FAILED) {
+        perror("mmap失败");
+        close(fd_in);
+        exit(1);
     }
+    close(fd_in);
+    phase_done("映射");
     
-    // 归并所有已排序的块
-    // 先将第一个块复制到输出缓冲区
-    int first_chunk_size = records_per_thread + (0 < remainder ? 1 : 0);
-    memcpy(output_data, input_data, first_chunk_size * RECORD_SIZE);
-    int merged_size = first_chunk_size;
-    
-    // 依次归并后续块
-    offset = first_chunk_size;
-    for (int i = 1; i < num_threads; i++) {
-        int chunk_size = records_per_thread + (i < remainder ? 1 : 0);
-        unsigned char *chunk_start = input_data + offset * RECORD_SIZE;
-        
-        // 使用临时缓冲区进行归并
-        merge_chunks(output_data, merged_size, 
-                    chunk_start, chunk_size, 
-                    temp_buffer);
-        
-        // 将归并结果复制回output_data
-        memcpy(output_data, temp_buffer, (merged_size + chunk_size) * RECORD_SIZE);
-        
-        merged_size += chunk_size;
-        offset += chunk_size;
+    // 输出文件先设好大小再共享映射：各线程把自己那段直接写进页缓存，
+    // 内核一边在后台回写，不需要完整的输出缓冲区，也不用最后再 fwrite 一遍
+    size_t output_size = (size_t)num_records * RECORD_SIZE;
+    if (ftruncate(fd_out, output_size) < 0) {
+        perror("无法设置输出文件大小");
+        exit(1);
     }
-    
-    // 写入输出文件
-    FILE *fp_out = fopen(output_file, "wb");
-    if (!fp_out) {
-        perror("无法打开输出文件");
-        free(output_data);
-        free(temp_buffer);
-        free(threads);
-        free(args);
+    unsigned char *output_data = mmap(NULL, output_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      fd_out, 0);
+    if (output_data == MAP_FAILED) {
+        perror("mmap失败");
         munmap(input_data, file_size);
         exit(1);
     }
     
-    if (fwrite(output_data, RECORD_SIZE, num_records, fp_out) != num_records) {
-        perror("写入文件失败");
-        fclose(fp_out);
-        free(output_data);
-        free(temp_buffer);
-        free(threads);
-        free(args);
+    // 标签数组和同样大小的临时空间
+    Tag *tags = malloc(num_records * sizeof(Tag));
+    Tag *aux = malloc(num_records * sizeof(Tag));
+    
+    if (!tags || !aux) {
+        perror("内存分配失败");
+        munmap(output_data, output_size);
         munmap(input_data, file_size);
         exit(1);
     }
     
-    // 强制同步到磁盘
-    int fd_out = fileno(fp_out);
+    if (sample)
+        sample_sort_records(input_data, num_records, output_data, num_threads, tags, aux);
+    else
+        merge_sort_records(input_data, num_records, output_data, num_threads, tags, aux);
+    free(tags);
+    free(aux);
+    
+    // 强制同步到磁盘（共享映射的脏页就是文件的页缓存，fsync 一并写回）
+    munmap(output_data, output_size);
     if (fsync(fd_out) < 0) {
         perror("fsync失败");
     }
-    
-    fclose(fp_out);
+    close(fd_out);
+    phase_done("fsync");
     
     // 清理资源
-    free(output_data);
-    free(temp_buffer);
-    free(threads);
-    free(args);
     munmap(input_data, file_size);
     
     return 0;
 }
-
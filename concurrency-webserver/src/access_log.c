@@ -0,0 +1,88 @@
+#include "io_helper.h"
+#include "access_log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+// A bounded MPSC ring (Vyukov): a slot's seq equals the position that may be
+// written next, and position + 1 once that line is ready to print
+typedef struct {
+  unsigned long seq;
+  char line[ACCESS_LOG_LINE];
+} log_slot_t;
+
+static int log_mode = LOG_SYNC;
+static log_slot_t *slots;
+static unsigned long tail __attribute__((aligned(64))); // next to write
+static unsigned long head __attribute__((aligned(64))); // next to print
+static unsigned long dropped;
+
+// Print queued lines; when there are none, flush and nap
+static void *log_thread(void *arg) {
+  while (1) {
+    log_slot_t *slot = &slots[head % ACCESS_LOG_SLOTS];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1) {
+      fflush(stdout);
+      struct timespec nap = {0, 10 * 1000 * 1000};
+      nanosleep(&nap, NULL);
+      continue;
+    }
+    fputs(slot->line, stdout);
+    __atomic_store_n(&slot->seq, head + ACCESS_LOG_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+void access_log_init(int mode) {
+  log_mode = mode;
+  if (mode != LOG_ASYNC)
+    return;
+  slots = malloc(sizeof(log_slot_t) * ACCESS_LOG_SLOTS);
+  assert(slots != NULL);
+  for (unsigned long i = 0; i < ACCESS_LOG_SLOTS; i++)
+    slots[i].seq = i;
+  pthread_t tid;
+  pthread_create(&tid, NULL, log_thread, NULL);
+  pthread_detach(tid);
+}
+
+void access_log(char *fmt, ...) {
+  va_list ap;
+  if (log_mode == LOG_NONE)
+    return;
+  if (log_mode == LOG_SYNC) {
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  // claim a slot with one CAS, unless the printer is a lap behind
+  unsigned long pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  log_slot_t *slot;
+  while (1) {
+    slot = &slots[pos % ACCESS_LOG_SLOTS];
+    unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED); // full
+      return;
+    } else {
+      pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+  }
+  va_start(ap, fmt);
+  if (vsnprintf(slot->line, ACCESS_LOG_LINE, fmt, ap) >= ACCESS_LOG_LINE)
+    slot->line[ACCESS_LOG_LINE - 2] = '\n'; // truncated: still end the line
+  va_end(ap);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long access_log_dropped() {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
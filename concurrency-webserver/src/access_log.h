@@ -0,0 +1,26 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+//
+// Per-request log lines on stdout (wserver -L). LOG_SYNC prints from the
+// worker, which serializes workers on the stdio lock; LOG_ASYNC instead
+// queues the line in a lock-free ring that one thread drains to stdout.
+// When the ring is full, lines are dropped (and counted), so logging never
+// holds up a worker.
+//
+
+#define LOG_NONE (0)
+#define LOG_SYNC (1)
+#define LOG_ASYNC (2)
+
+#define ACCESS_LOG_SLOTS (4096) // lines the ring holds (a power of 2)
+#define ACCESS_LOG_LINE (256)   // longer lines are truncated
+
+void access_log_init(int mode);
+
+void access_log(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Lines lost to a full ring so far
+unsigned long access_log_dropped();
+
+#endif // __ACCESS_LOG_H__
@@ -0,0 +1,220 @@
+#include "io_helper.h"
+#include "fd_cache.h"
+#include <pthread.h>
+#include <sys/resource.h>
+
+static fd_entry_t **buckets;
+static int num_buckets;
+static int capacity;
+static int count;
+static fd_entry_t *lru_head; // most recently used
+static fd_entry_t *lru_tail; // least recently used
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hash(char *s) {
+  unsigned long h = 5381;
+  int c;
+  while ((c = *s++) != '\0')
+    h = h * 33 + c;
+  return h;
+}
+
+void fd_cache_init(int size) {
+  // leave at least half the descriptor limit for sockets and CGI pipes
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+      (rlim_t)size > rl.rlim_cur / 2)
+    size = rl.rlim_cur / 2;
+  if (size < 1)
+    size = 1;
+  capacity = size;
+  num_buckets = 2 * size;
+  buckets = calloc(num_buckets, sizeof(fd_entry_t *));
+  assert(buckets != NULL);
+}
+
+// Whether a new stat() still describes the file we have open
+// (ctime also catches chmod, which leaves mtime alone)
+int fd_cache_same_file(struct stat *a, struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && a->st_mode == b->st_mode &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+         a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+         a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static void lru_unlink(fd_entry_t *e) {
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(fd_entry_t *e) {
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = e;
+  else
+    lru_tail = e;
+  lru_head = e;
+}
+
+static fd_entry_t *lookup(char *filename) {
+  fd_entry_t *e = buckets[hash(filename) % num_buckets];
+  while (e && strcmp(e->filename, filename) != 0)
+    e = e->hash_next;
+  return e;
+}
+
+static void entry_free(fd_entry_t *e) {
+  if (e->fd >= 0)
+    close_or_die(e->fd);
+  free(e->filename);
+  free(e);
+}
+
+// Drop the cache's reference to an entry (caller holds lock)
+// Returns 1 if that was the last reference and the entry must be freed
+static int remove_entry(fd_entry_t *e) {
+  fd_entry_t **pp = &buckets[hash(e->filename) % num_buckets];
+  while (*pp != e)
+    pp = &(*pp)->hash_next;
+  *pp = e->hash_next;
+  lru_unlink(e);
+  e->cached = 0;
+  count--;
+  return --e->refs == 0;
+}
+
+// Drop the least recently used entry, to give back its descriptor
+// Returns 0 if there was nothing left to drop
+static int evict_one() {
+  pthread_mutex_lock(&lock);
+  fd_entry_t *victim = lru_tail;
+  int last = victim ? remove_entry(victim) : 0;
+  pthread_mutex_unlock(&lock);
+  if (last)
+    entry_free(victim);
+  return victim != NULL;
+}
+
+// Drop the cache's reference to 'e' if it is still cached
+static void invalidate(fd_entry_t *e) {
+  int last = 0;
+  pthread_mutex_lock(&lock);
+  if (e->cached)
+    last = remove_entry(e);
+  pthread_mutex_unlock(&lock);
+  if (last)
+    entry_free(e);
+}
+
+fd_entry_t *fd_cache_get(char *filename) {
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&lock);
+  fd_entry_t *e = lookup(filename);
+  if (e) {
+    e->refs++;
+    lru_unlink(e);
+    lru_push_front(e);
+    if (now - e->checked < FD_CACHE_REVALIDATE) {
+      pthread_mutex_unlock(&lock);
+      return e;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  // missing, or due for a check: go to the file system (outside the lock)
+  struct stat st;
+  if (stat(filename, &st) < 0) {
+    int saved_errno = errno;
+    if (e) {
+      invalidate(e);
+      fd_cache_put(e);
+    }
+    errno = saved_errno;
+    return NULL;
+  }
+  if (e) {
+    if (fd_cache_same_file(&e->st, &st)) {
+      pthread_mutex_lock(&lock);
+      e->checked = now;
+      pthread_mutex_unlock(&lock);
+      return e;
+    }
+    invalidate(e); // the file changed under us
+    fd_cache_put(e);
+  }
+
+  e = malloc(sizeof(fd_entry_t));
+  assert(e != NULL);
+  e->filename = strdup(filename);
+  assert(e->filename != NULL);
+  e->fd = -1;
+  e->st = st;
+  e->checked = now;
+  e->error = 0;
+  e->refs = 1;
+  e->cached = 0;
+  e->hash_next = e->lru_prev = e->lru_next = NULL;
+  if (!S_ISREG(st.st_mode) || !(S_IRUSR & st.st_mode))
+    return e; // not servable: handed out once, never cached
+  // out of descriptors: close cached ones (least recently used first)
+  while ((e->fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) {
+    if ((errno != EMFILE && errno != ENFILE) || !evict_one()) {
+      e->error = errno;
+      return e;
+    }
+  }
+  fstat_or_die(e->fd, &e->st);
+
+  // cache it, replacing whatever another thread may have raced in
+  fd_entry_t *evicted = NULL;
+  pthread_mutex_lock(&lock);
+  fd_entry_t *old = lookup(filename);
+  if (old && remove_entry(old))
+    evicted = old; // freed below, outside the lock
+  unsigned long b = hash(filename) % num_buckets;
+  e->hash_next = buckets[b];
+  buckets[b] = e;
+  lru_push_front(e);
+  e->cached = 1;
+  e->refs++;
+  count++;
+  pthread_mutex_unlock(&lock);
+  if (evicted)
+    entry_free(evicted);
+
+  // keep the cache within its capacity (least recently used go first)
+  while (1) {
+    fd_entry_t *victim = NULL;
+    int last = 0;
+    pthread_mutex_lock(&lock);
+    if (count > capacity) {
+      victim = lru_tail;
+      last = remove_entry(victim);
+    }
+    pthread_mutex_unlock(&lock);
+    if (victim == NULL)
+      break;
+    if (last)
+      entry_free(victim);
+  }
+  return e;
+}
+
+void fd_cache_put(fd_entry_t *e) {
+  pthread_mutex_lock(&lock);
+  int last = --e->refs == 0;
+  pthread_mutex_unlock(&lock);
+  if (last)
+    entry_free(e);
+}
@@ -0,0 +1,46 @@
+#ifndef __FD_CACHE_H__
+#define __FD_CACHE_H__
+
+#include <sys/stat.h>
+#include <time.h>
+
+//
+// LRU cache of open file descriptors (plus their stat results) for static
+// files, keyed by the filename that request_parse_uri() resolves.
+// Entries are re-checked against the file system (stat: inode, size, mtime)
+// at most once every FD_CACHE_REVALIDATE seconds, so a hot file costs no
+// open()/stat() at all in between, and an edited file is picked up quickly.
+// The cache never holds more than half of RLIMIT_NOFILE, and gives its
+// descriptors back if open() runs out of them.
+//
+
+#define FD_CACHE_SIZE (1024)     // default number of cached descriptors
+                                 // (capped at half of RLIMIT_NOFILE)
+#define FD_CACHE_REVALIDATE (1) // seconds between checks of a cached file
+
+typedef struct fd_entry {
+  char *filename;
+  int fd;          // open O_RDONLY descriptor (-1 if the file is not readable)
+  struct stat st;  // fstat() of fd (or stat() of filename if fd is -1)
+  time_t checked;  // last time st was compared against the file system
+  int error;       // errno of a failed open() (fd == -1), or 0
+  int refs;        // one per user, plus one while the cache holds it
+  int cached;      // whether the entry is still in the cache
+  struct fd_entry *hash_next;
+  struct fd_entry *lru_prev, *lru_next;
+} fd_entry_t;
+
+void fd_cache_init(int capacity);
+
+// Returns a pinned entry for 'filename', or NULL (with errno set by stat())
+// if it does not exist. Non-regular or unreadable files come back with
+// fd == -1, so callers can still look at st and error to pick a reply.
+fd_entry_t *fd_cache_get(char *filename);
+
+// Unpin an entry returned by fd_cache_get()
+void fd_cache_put(fd_entry_t *e);
+
+// Whether two stat() results describe the same, unchanged file
+int fd_cache_same_file(struct stat *a, struct stat *b);
+
+#endif // __FD_CACHE_H__
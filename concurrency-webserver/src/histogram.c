@@ -0,0 +1,74 @@
+#include "histogram.h"
+#include <string.h>
+
+void hist_init(histogram_t *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = ~0ULL;
+}
+
+// Values below HIST_SUB_COUNT get a bucket each. Above that, a value whose
+// top bit is bit (HIST_SUB_BITS - 1 + e) is shifted right by e, leaving a
+// sub-bucket number in [HIST_SUB_COUNT / 2, HIST_SUB_COUNT)
+static int bucket_of(unsigned long long value) {
+  if (value < HIST_SUB_COUNT)
+    return value;
+  int e = (63 - __builtin_clzll(value)) - (HIST_SUB_BITS - 1);
+  return e * (HIST_SUB_COUNT / 2) + (value >> e);
+}
+
+// Largest value that lands in bucket 'b'
+static unsigned long long bucket_top(int b) {
+  if (b < HIST_SUB_COUNT)
+    return b;
+  int e = b / (HIST_SUB_COUNT / 2) - 1;
+  unsigned long long sub = b - e * (HIST_SUB_COUNT / 2);
+  return ((sub + 1) << e) - 1;
+}
+
+void hist_record(histogram_t *h, unsigned long long value) {
+  unsigned long long clamped = value;
+  if (clamped >= (1ULL << HIST_MAX_BITS))
+    clamped = (1ULL << HIST_MAX_BITS) - 1;
+  h->counts[bucket_of(clamped)]++;
+  h->total++;
+  h->sum += value;
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+void hist_merge(histogram_t *dst, histogram_t *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+unsigned long long hist_percentile(histogram_t *h, double percentile) {
+  if (h->total == 0)
+    return 0;
+  // rank of the value we want, counting from 1
+  unsigned long rank = (unsigned long)(percentile / 100.0 * h->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > h->total)
+    rank = h->total;
+  unsigned long seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      unsigned long long top = bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+double hist_mean(histogram_t *h) {
+  return h->total ? (double)h->sum / h->total : 0.0;
+}
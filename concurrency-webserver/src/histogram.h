@@ -0,0 +1,37 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+//
+// Latency histogram in the style of HdrHistogram. Values are bucketed
+// log-linearly: each power of two is split into HIST_SUB_COUNT / 2 equal
+// sub-buckets, so a percentile is reported to within 1 / 64 (~1.6%) of the
+// true value whatever its magnitude, in a fixed ~18 KB of counters.
+// Recording is a few shifts and an increment; histograms of the same layout
+// can be merged by adding counters, so each thread keeps its own.
+//
+
+#define HIST_SUB_BITS (7)
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS (40) // largest value tracked: 2^40 - 1 (~12 days in us)
+#define HIST_BUCKETS                                                           \
+  ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB_COUNT / 2))
+
+typedef struct {
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long total;    // values recorded
+  unsigned long long min; // smallest value recorded (exact)
+  unsigned long long max; // largest value recorded (exact)
+  unsigned long long sum; // for the mean
+} histogram_t;
+
+void hist_init(histogram_t *h);
+// Record one value (larger than the tracked range: counted as the largest)
+void hist_record(histogram_t *h, unsigned long long value);
+// Add every value recorded in 'src' to 'dst'
+void hist_merge(histogram_t *dst, histogram_t *src);
+// The value below which 'percentile' (0-100) percent of values fall
+// (reported as the top of its bucket); 0 if nothing was recorded
+unsigned long long hist_percentile(histogram_t *h, double percentile);
+double hist_mean(histogram_t *h);
+
+#endif // __HISTOGRAM_H__
@@ -1,27 +1,228 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-  char c;
+void rio_init(rio_t *rp, int fd) {
+  rp->fd = fd;
+  rp->cnt = 0;
+  rp->bufp = rp->buf;
+}
+
+// Wait until a descriptor that returned EAGAIN is ready again
+// Returns 0 when ready, -1 (errno ETIMEDOUT) after IO_TIMEOUT_MS
+int io_wait(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  int rc;
+  do {
+    rc = poll(&pfd, 1, IO_TIMEOUT_MS);
+  } while (rc < 0 && errno == EINTR);
+  if (rc == 0)
+    errno = ETIMEDOUT;
+  return rc > 0 ? 0 : -1;
+}
+
+// read() that retries on EINTR and waits out EAGAIN
+static ssize_t io_read(int fd, void *buf, size_t count) {
+  while (1) {
+    ssize_t rc = read(fd, buf, count);
+    if (rc >= 0)
+      return rc;
+    if (errno == EINTR)
+      continue;
+    if ((errno == EAGAIN || errno == EWOULDBLOCK) && io_wait(fd, POLLIN) == 0)
+      continue;
+    return -1;
+  }
+}
+
+// Refill the buffer with one large read; only called when it is empty.
+// Returns bytes read, 0 on EOF, -1 on error
+static ssize_t rio_fill(rio_t *rp) {
+  ssize_t rc = io_read(rp->fd, rp->buf, sizeof(rp->buf));
+  if (rc > 0) {
+    rp->cnt = rc;
+    rp->bufp = rp->buf;
+  }
+  return rc;
+}
+
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen) {
   char *bufp = buf;
-  int n;
-  for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-    int rc;
-    if ((rc = read_or_die(fd, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n')
-        break;
-    } else if (rc == 0) {
-      if (n == 1)
-        return 0; /* EOF, no data read */
-      else
-        break; /* EOF, some data was read */
-    } else
-      return -1; /* error */
+  size_t n = 0;
+  while (n < maxlen - 1) { // leave room at end for '\0'
+    if (rp->cnt == 0) {
+      ssize_t rc = rio_fill(rp);
+      if (rc == 0)
+        break; /* EOF */
+      if (rc < 0)
+        return -1; /* error */
+    }
+    size_t len = rp->cnt < maxlen - 1 - n ? rp->cnt : maxlen - 1 - n;
+    char *nl = memchr(rp->bufp, '\n', len);
+    if (nl != NULL)
+      len = nl - rp->bufp + 1;
+    memcpy(bufp, rp->bufp, len);
+    bufp += len;
+    n += len;
+    rp->bufp += len;
+    rp->cnt -= len;
+    if (nl != NULL)
+      break;
   }
   *bufp = '\0';
   return n;
 }
 
+// Like rio_readline(), but leaves the line in the buffer so that the next
+// rio_readline() still returns it. The line must fit in RIO_BUFSIZE; a longer
+// one is returned truncated.
+ssize_t rio_peekline(rio_t *rp, void *buf, size_t maxlen) {
+  char *nl;
+  while ((nl = memchr(rp->bufp, '\n', rp->cnt)) == NULL &&
+         rp->cnt < sizeof(rp->buf)) {
+    // move the partial line to the front and read more behind it
+    memmove(rp->buf, rp->bufp, rp->cnt);
+    rp->bufp = rp->buf;
+    ssize_t rc = io_read(rp->fd, rp->buf + rp->cnt, sizeof(rp->buf) - rp->cnt);
+    if (rc == 0)
+      break; /* EOF */
+    if (rc < 0)
+      return -1; /* error */
+    rp->cnt += rc;
+  }
+  size_t len = nl != NULL ? nl - rp->bufp + 1 : rp->cnt;
+  if (len > maxlen - 1)
+    len = maxlen - 1;
+  memcpy(buf, rp->bufp, len);
+  ((char *)buf)[len] = '\0';
+  return len;
+}
+
+// Read up to n raw bytes, serving buffered data first.
+// Returns fewer than n bytes only on EOF
+ssize_t rio_readn(rio_t *rp, void *buf, size_t n) {
+  char *bufp = buf;
+  size_t left = n;
+  while (left > 0) {
+    if (rp->cnt == 0) {
+      // large reads bypass the buffer entirely
+      if (left >= sizeof(rp->buf)) {
+        ssize_t rc = io_read(rp->fd, bufp, left);
+        if (rc < 0)
+          return -1;
+        if (rc == 0)
+          break;
+        bufp += rc;
+        left -= rc;
+        continue;
+      }
+      ssize_t rc = rio_fill(rp);
+      if (rc < 0)
+        return -1;
+      if (rc == 0)
+        break;
+    }
+    size_t len = rp->cnt < left ? rp->cnt : left;
+    memcpy(bufp, rp->bufp, len);
+    bufp += len;
+    left -= len;
+    rp->bufp += len;
+    rp->cnt -= len;
+  }
+  return n - left;
+}
+
+// Append whatever the socket has to offer right now, without blocking.
+// Returns bytes read, 0 on EOF, -1 on error (errno EAGAIN: nothing there yet,
+// ENOBUFS: the buffer is already full)
+ssize_t rio_fill_nonblock(rio_t *rp) {
+  if (rp->bufp != rp->buf) {
+    memmove(rp->buf, rp->bufp, rp->cnt);
+    rp->bufp = rp->buf;
+  }
+  if (rp->cnt == sizeof(rp->buf)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  ssize_t rc;
+  do {
+    rc = recv(rp->fd, rp->buf + rp->cnt, sizeof(rp->buf) - rp->cnt,
+              MSG_DONTWAIT);
+  } while (rc < 0 && errno == EINTR);
+  if (rc > 0)
+    rp->cnt += rc;
+  return rc;
+}
+
+// Whether a complete request header (up to the empty "\r\n" line that
+// request_read_headers() stops at) is buffered
+int rio_has_header(rio_t *rp) {
+  return memmem(rp->bufp, rp->cnt, "\n\r\n", 3) != NULL;
+}
+
+ssize_t writen(int fd, const void *buf, size_t n) {
+  const char *bufp = buf;
+  size_t left = n;
+  while (left > 0) {
+    ssize_t rc = write(fd, bufp, left);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        io_wait(fd, POLLOUT) == 0)
+      continue;
+    if (rc < 0)
+      return -1;
+    bufp += rc;
+    left -= rc;
+  }
+  return n;
+}
+
+// note: advances 'iov' past whatever has been written
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  while (iovcnt > 0) {
+    ssize_t rc = writev(fd, iov, iovcnt);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        io_wait(fd, POLLOUT) == 0)
+      continue;
+    if (rc < 0)
+      return -1;
+    total += rc;
+    // skip the buffers that went out completely, trim the partial one
+    while (iovcnt > 0 && (size_t)rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return total;
+}
+
+ssize_t sendfilen(int out_fd, int in_fd, off_t offset, size_t count) {
+  size_t left = count;
+  while (left > 0) {
+    // with an explicit offset, in_fd's own file position is left alone, so
+    // one descriptor can be shared by concurrent requests
+    ssize_t rc = sendfile(out_fd, in_fd, &offset, left);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+        io_wait(out_fd, POLLOUT) == 0)
+      continue;
+    if (rc < 0)
+      return -1;
+    if (rc == 0)
+      break; // file shrank underneath us
+    left -= rc;
+  }
+  return count - left;
+}
+
 int open_client_fd(char *hostname, int port) {
   int client_fd;
   struct hostent *hp;
@@ -44,10 +245,12 @@ int open_client_fd(char *hostname, int port) {
   return client_fd;
 }
 
-int open_listen_fd(int port) {
+int open_listen_fd(int port) { return open_listen_fd_opts(port, 0); }
+
+int open_listen_fd_opts(int port, int flags) {
   // Create a socket descriptor
   int listen_fd;
-  if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
     fprintf(stderr, "socket() failed\n");
     return -1;
   }
@@ -59,6 +262,25 @@ int open_listen_fd(int port) {
     fprintf(stderr, "setsockopt() failed\n");
     return -1;
   }
+  if ((flags & LISTEN_REUSEPORT) &&
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) <
+          0) {
+    fprintf(stderr, "setsockopt(SO_REUSEPORT) failed\n");
+    return -1;
+  }
+  if ((flags & LISTEN_NODELAY) &&
+      setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int)) <
+          0) {
+    fprintf(stderr, "setsockopt(TCP_NODELAY) failed\n");
+    return -1;
+  }
+  int defer = LISTEN_DEFER_SECS;
+  if ((flags & LISTEN_DEFER_ACCEPT) &&
+      setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer,
+                 sizeof(int)) < 0) {
+    fprintf(stderr, "setsockopt(TCP_DEFER_ACCEPT) failed\n");
+    return -1;
+  }
 
   // Listen_fd will be an endpoint for all requests to port on any IP address
   // for this host
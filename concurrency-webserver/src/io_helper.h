@@ -1,6 +1,10 @@
 #ifndef __IO_HELPER__
 #define __IO_HELPER__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strcasestr() and friends
+#endif
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
@@ -8,6 +12,8 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,10 +21,12 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -145,15 +153,69 @@ typedef struct sockaddr sockaddr_t;
     p;                                                                         \
   })
 
+// buffered connection reader
+// fills 'buf' with large reads and hands out lines and raw bytes from it,
+// so that a request costs a handful of read() calls instead of one per byte;
+// whatever is left over stays in the buffer for the next caller
+#define RIO_BUFSIZE (8192)
+typedef struct {
+  int fd;                // descriptor being read
+  ssize_t cnt;           // unread bytes in buf
+  char *bufp;            // next unread byte in buf
+  char buf[RIO_BUFSIZE]; // internal buffer
+} rio_t;
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t rio_peekline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t rio_readn(rio_t *rp, void *buf, size_t n);
+ssize_t rio_fill_nonblock(rio_t *rp);
+int rio_has_header(rio_t *rp);
+
+// blocking helpers above also work on O_NONBLOCK descriptors: on EAGAIN they
+// wait up to IO_TIMEOUT_MS for the descriptor, then fail with ETIMEDOUT
+#define IO_TIMEOUT_MS (30000)
+
+// write all n bytes (retrying short writes); returns n, or -1 on error
+// (e.g. EPIPE when the peer has gone away) instead of dying
+ssize_t writen(int fd, const void *buf, size_t n);
+// same, gathering from 'iovcnt' buffers in as few writev() calls as possible
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt);
+// same, for 'count' bytes of file 'in_fd' starting at 'offset' (sendfile)
+ssize_t sendfilen(int out_fd, int in_fd, off_t offset, size_t count);
+// wait (up to IO_TIMEOUT_MS) for a descriptor that returned EAGAIN
+int io_wait(int fd, short events);
+
 // client/server helper functions
-ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+// same, with LISTEN_* options
+int open_listen_fd_opts(int portno, int flags);
+
+// open_listen_fd_opts() flags
+#define LISTEN_REUSEPORT (1 << 0)    // SO_REUSEPORT: several sockets share port,
+                                     // the kernel balances connections over them
+#define LISTEN_NODELAY (1 << 1)      // TCP_NODELAY (inherited by accept()ed fds)
+#define LISTEN_DEFER_ACCEPT (1 << 2) // TCP_DEFER_ACCEPT: accept() only returns
+                                     // once the client has sent data
+#define LISTEN_DEFER_SECS (10)       // how long the kernel defers for
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen)                                       \
+#define rio_readline_or_die(rp, buf, maxlen)                                   \
+  ({                                                                           \
+    ssize_t rc = rio_readline(rp, buf, maxlen);                                \
+    assert(rc >= 0);                                                           \
+    rc;                                                                        \
+  })
+#define rio_peekline_or_die(rp, buf, maxlen)                                   \
+  ({                                                                           \
+    ssize_t rc = rio_peekline(rp, buf, maxlen);                                \
+    assert(rc >= 0);                                                           \
+    rc;                                                                        \
+  })
+#define rio_readn_or_die(rp, buf, n)                                           \
   ({                                                                           \
-    ssize_t rc = readline(fd, buf, maxlen);                                    \
+    ssize_t rc = rio_readn(rp, buf, n);                                        \
     assert(rc >= 0);                                                           \
     rc;                                                                        \
   })
@@ -169,5 +231,11 @@ int open_listen_fd(int portno);
     assert(rc >= 0);                                                           \
     rc;                                                                        \
   })
+#define open_listen_fd_opts_or_die(port, flags)                                \
+  ({                                                                           \
+    int rc = open_listen_fd_opts(port, flags);                                 \
+    assert(rc >= 0);                                                           \
+    rc;                                                                        \
+  })
 
 #endif // __IO_HELPER__
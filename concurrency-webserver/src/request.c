@@ -1,5 +1,11 @@
 #include "request.h"
+#include "fd_cache.h"
 #include "io_helper.h"
+#include "resp_cache.h"
+#include "access_log.h"
+#include "stats.h"
+#include <pthread.h>
+#include <spawn.h>
 
 //
 // Some of this code stolen from Bryant/O'Halloran
@@ -8,8 +14,13 @@
 
 #define MAXBUF (8192)
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg,
-                   char *longmsg) {
+// value of the Connection: header we send back
+static char *connection_header(int keep_alive) {
+  return keep_alive ? "keep-alive" : "close";
+}
+
+static void request_error_conn(int fd, int keep_alive, char *cause,
+                               char *errnum, char *shortmsg, char *longmsg) {
   char buf[MAXBUF], body[MAXBUF];
 
   // Create the body of error message first (have to know its length for header)
@@ -27,30 +38,44 @@ void request_error(int fd, char *cause, char *errnum, char *shortmsg,
           errnum, shortmsg, longmsg, cause);
 
   // Write out the header information for this response
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  write_or_die(fd, buf, strlen(buf));
-
-  sprintf(buf, "Content-Type: text/html\r\n");
-  write_or_die(fd, buf, strlen(buf));
-
-  sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-  write_or_die(fd, buf, strlen(buf));
+  int n = snprintf(buf, MAXBUF,
+                   ""
+                   "HTTP/1.1 %s %s\r\n"
+                   "Content-Type: text/html\r\n"
+                   "Content-Length: %lu\r\n"
+                   "Connection: %s\r\n\r\n",
+                   errnum, shortmsg, strlen(body),
+                   connection_header(keep_alive));
+  stats_response(atoi(errnum), strlen(body));
+  if (writen(fd, buf, n) < 0)
+    return;
 
   // Write out the body last
-  write_or_die(fd, body, strlen(body));
+  writen(fd, body, strlen(body));
+}
+
+void request_error(int fd, char *cause, char *errnum, char *shortmsg,
+                   char *longmsg) {
+  request_error_conn(fd, 0, cause, errnum, shortmsg, longmsg);
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Reads everything up to an empty text line, noting any Connection: header.
+// Returns -1 if the connection ended before the headers did
 //
-void request_read_headers(int fd) {
+int request_read_headers(rio_t *rp, int *keep_alive) {
   char buf[MAXBUF];
-
-  readline_or_die(fd, buf, MAXBUF);
-  while (strcmp(buf, "\r\n")) {
-    readline_or_die(fd, buf, MAXBUF);
+  ssize_t n;
+
+  while ((n = rio_readline(rp, buf, MAXBUF)) > 0 && strcmp(buf, "\r\n")) {
+    if (strncasecmp(buf, "Connection:", 11) == 0) {
+      if (strcasestr(buf + 11, "close"))
+        *keep_alive = 0;
+      else if (strcasestr(buf + 11, "keep-alive"))
+        *keep_alive = 1;
+    }
   }
-  return;
+  return n > 0 ? 0 : -1;
 }
 
 //
@@ -96,134 +121,271 @@ void request_get_filetype(char *filename, char *filetype) {
     strcpy(filetype, "text/plain");
 }
 
+// CGI children are reaped by a single thread, so no worker ever blocks on
+// (or reaps) a child: it hands the socket to the CGI program and moves on
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t children_cond = PTHREAD_COND_INITIALIZER;
+static int children; // spawned and not yet reaped
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+static void *reaper_thread(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&children_lock);
+    while (children == 0)
+      pthread_cond_wait(&children_cond, &children_lock);
+    pthread_mutex_unlock(&children_lock);
+
+    // every child of the server is a CGI program, and we are the only one
+    // waiting for them
+    if (waitpid(-1, NULL, 0) < 0) {
+      assert(errno == EINTR);
+      continue;
+    }
+    pthread_mutex_lock(&children_lock);
+    children--;
+    pthread_mutex_unlock(&children_lock);
+  }
+  return NULL;
+}
+
+static void reaper_start() {
+  pthread_t tid;
+  pthread_create(&tid, NULL, reaper_thread, NULL);
+  pthread_detach(tid);
+}
+
 void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-  char buf[MAXBUF], *argv[] = {NULL};
+  char buf[MAXBUF], query[MAXBUF], *argv[] = {filename, NULL};
 
   // The server does only a little bit of the header.
-  // The CGI script has to finish writing out the header.
+  // The CGI program has to finish writing out the header.
+  // We cannot know where its output ends, so the connection closes after it.
   sprintf(buf, ""
-               "HTTP/1.0 200 OK\r\n"
-               "Server: OSTEP WebServer\r\n");
+               "HTTP/1.1 200 OK\r\n"
+               "Server: OSTEP WebServer\r\n"
+               "Connection: close\r\n");
 
-  write_or_die(fd, buf, strlen(buf));
+  stats_response(200, 0); // (the body is the program's business)
+  if (writen(fd, buf, strlen(buf)) < 0)
+    return;
 
-  if (fork_or_die() == 0) {                    // child
-    setenv_or_die("QUERY_STRING", cgiargs, 1); // args to cgi go here
-    dup2_or_die(fd, STDOUT_FILENO); // make cgi writes go to socket (not screen)
-    extern char **environ;          // defined by libc
-    execve_or_die(filename, argv, environ);
-  } else {
-    wait_or_die(NULL);
-  }
+  // The environment is passed explicitly: setenv() in this (multithreaded)
+  // process would race with other workers' requests
+  extern char **environ; // defined by libc
+  int n = 0;
+  while (environ[n] != NULL)
+    n++;
+  char **envp = malloc(sizeof(char *) * (n + 2));
+  assert(envp != NULL);
+  int envc = 0;
+  for (int i = 0; i < n; i++)
+    if (strncmp(environ[i], "QUERY_STRING=", 13) != 0)
+      envp[envc++] = environ[i];
+  snprintf(query, MAXBUF, "QUERY_STRING=%s", cgiargs); // args to cgi go here
+  envp[envc++] = query;
+  envp[envc] = NULL;
+
+  // the CGI program expects plain blocking writes (our sockets are
+  // non-blocking); the flag is shared with our descriptor, but we are done
+  // writing to it
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  // posix_spawn() does not copy the server's address space like fork() does
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  // make cgi writes go to socket (not screen)
+  posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+  pid_t pid;
+  int rc = posix_spawn(&pid, filename, &actions, NULL, argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  free(envp);
+  if (rc != 0)
+    return; // the client sees the connection close after the header
+
+  pthread_once(&reaper_once, reaper_start);
+  pthread_mutex_lock(&children_lock);
+  children++;
+  pthread_cond_signal(&children_cond);
+  pthread_mutex_unlock(&children_lock);
+  // the child holds its own copy of the socket: the caller can close ours,
+  // and the client sees EOF when the program exits
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-  int srcfd;
-  char *srcp, filetype[MAXBUF], buf[MAXBUF];
+// The /__stats report (see stats.h)
+void request_serve_stats(int fd, int keep_alive) {
+  char head[MAXBUF], body[4 * MAXBUF];
+  int len = stats_format(body, sizeof(body));
+  stats_response(200, len);
+  int n = snprintf(head, MAXBUF,
+                   ""
+                   "HTTP/1.1 200 OK\r\n"
+                   "Server: OSTEP WebServer\r\n"
+                   "Content-Length: %d\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Cache-Control: no-store\r\n"
+                   "Connection: %s\r\n\r\n",
+                   len, connection_header(keep_alive));
+  struct iovec iov[2] = {{head, n}, {body, len}};
+  writevn(fd, iov, 2);
+}
 
-  request_get_filetype(filename, filetype);
-  srcfd = open_or_die(filename, O_RDONLY, 0);
+// Send a cached response: precomputed header, Connection: line, body,
+// all in a single writev()
+// returns 0 if the whole response went out, -1 if the client went away
+int request_serve_cached(int fd, resp_entry_t *e, int keep_alive, int hit) {
+  char buf[MAXBUF];
+  int n = sprintf(buf,
+                  ""
+                  "X-Cache: %s\r\n"
+                  "Connection: %s\r\n\r\n",
+                  hit ? "HIT" : "MISS", connection_header(keep_alive));
+  struct iovec iov[3] = {{e->data, e->head_len},
+                         {buf, n},
+                         {e->data + e->head_len, e->body_len}};
+  stats_response(200, e->body_len);
+  return writevn(fd, iov, 3) < 0 ? -1 : 0;
+}
 
-  // Rather than call read() to read the file into memory,
-  // which would require that we allocate a buffer, we memory-map the file
-  srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-  close_or_die(srcfd);
+// returns 0 if the whole response went out, -1 if the client went away
+int request_serve_static(int fd, char *filename, fd_entry_t *file,
+                         int keep_alive) {
+  char filetype[MAXBUF], buf[MAXBUF];
+  off_t filesize = file->st.st_size;
 
-  // put together response
-  sprintf(buf,
-          ""
-          "HTTP/1.0 200 OK\r\n"
-          "Server: OSTEP WebServer\r\n"
-          "Content-Length: %d\r\n"
-          "Content-Type: %s\r\n\r\n",
-          filesize, filetype);
+  request_get_filetype(filename, filetype);
 
-  write_or_die(fd, buf, strlen(buf));
+  // put together response (the Connection: line goes last, as it is the
+  // only part that depends on the request)
+  int n = snprintf(buf, MAXBUF,
+                   ""
+                   "HTTP/1.1 200 OK\r\n"
+                   "Server: OSTEP WebServer\r\n"
+                   "Content-Length: %lld\r\n"
+                   "Content-Type: %s\r\n",
+                   (long long)filesize, filetype);
+
+  // small files: keep the whole response around for next time
+  resp_entry_t *cached = resp_cache_fill(filename, file, buf, n);
+  if (cached) {
+    int rc = request_serve_cached(fd, cached, keep_alive, 0);
+    resp_cache_put(cached);
+    return rc;
+  }
 
-  //  Writes out to the client socket the memory-mapped file
-  write_or_die(fd, srcp, filesize);
-  munmap_or_die(srcp, filesize);
+  if (resp_cache_enabled())
+    n += sprintf(buf + n, "X-Cache: MISS\r\n");
+  n += sprintf(buf + n, "Connection: %s\r\n\r\n",
+               connection_header(keep_alive));
+
+  // MSG_MORE holds the header back (like TCP_CORK) so that it leaves in
+  // the same segment as the start of the body
+  ssize_t rc;
+  do {
+    rc = send(fd, buf, n, filesize > 0 ? MSG_MORE : 0);
+  } while (rc < 0 && (errno == EINTR || ((errno == EAGAIN ||
+                                          errno == EWOULDBLOCK) &&
+                                         io_wait(fd, POLLOUT) == 0)));
+  if (rc >= 0 && rc < n)
+    rc = writen(fd, buf + rc, n - rc);
+  if (rc < 0)
+    return -1;
+  stats_response(200, filesize);
+
+  // The body goes from the (cached) open file to the socket in the kernel,
+  // without being mapped or copied through user space
+  if (sendfilen(fd, file->fd, 0, filesize) != filesize)
+    return -1;
+  return 0;
 }
 
 // handle a request
-void request_handle(int fd) {
-  int is_static;
+// Returns 1 if the connection may be reused for another request (HTTP/1.1
+// default, or HTTP/1.0 with Connection: keep-alive), 0 if it must be closed.
+// 'allow_keep_alive' == 0 forces the connection closed after this response.
+int request_handle(rio_t *rp, int allow_keep_alive) {
+  int fd = rp->fd;
+  int is_static, keep_alive;
   struct stat sbuf;
   char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
   char filename[MAXBUF], cgiargs[MAXBUF];
+  long long t = stats_now_us();
 
-  readline_or_die(fd, buf, MAXBUF);
-  sscanf(buf, "%s %s %s", method, uri, version);
-  printf("method:%s uri:%s version:%s\n", method, uri, version);
+  if (rio_readline(rp, buf, MAXBUF) <= 0)
+    return 0; // client closed the connection (or it broke)
+  if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+    request_error(fd, buf, "400", "Bad Request",
+                  "server could not parse the request line");
+    return 0;
+  }
+  access_log("method:%s uri:%s version:%s\n", method, uri, version);
 
   if (strcasecmp(method, "GET")) {
     request_error(fd, method, "501", "Not Implemented",
                   "server does not implement this method");
-    return;
+    return 0;
   }
-  request_read_headers(fd);
+  keep_alive = strcasecmp(version, "HTTP/1.0") != 0; // 1.1 default
+  if (request_read_headers(rp, &keep_alive) < 0)
+    return 0;
+  keep_alive = keep_alive && allow_keep_alive;
+  t = stats_lap(STAGE_PARSE, t);
 
-  is_static = request_parse_uri(uri, filename, cgiargs);
-  if (stat(filename, &sbuf) < 0) {
-    request_error(fd, filename, "404", "Not found",
-                  "server could not find this file");
-    return;
+  if (strcmp(uri, "/__stats") == 0) {
+    request_serve_stats(fd, keep_alive);
+    return keep_alive;
   }
 
+  is_static = request_parse_uri(uri, filename, cgiargs);
   if (is_static) {
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-      request_error(fd, filename, "403", "Forbidden",
-                    "server could not read this file");
-      return;
+    // hot small files: the whole response is ready to go
+    resp_entry_t *cached = resp_cache_get(filename);
+    if (cached) {
+      t = stats_lap(STAGE_LOOKUP, t);
+      int rc = request_serve_cached(fd, cached, keep_alive, 1);
+      resp_cache_put(cached);
+      stats_lap(STAGE_SEND, t);
+      return rc < 0 ? 0 : keep_alive;
     }
-    request_serve_static(fd, filename, sbuf.st_size);
-  } else {
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-      request_error(fd, filename, "403", "Forbidden",
-                    "server could not run this CGI program");
-      return;
-    }
-    request_serve_dynamic(fd, filename, cgiargs);
-  }
-}
-
-// handle a request with first line already read (for SFF scheduling)
-void request_handle_with_first_line(int fd, char *first_line) {
-  int is_static;
-  struct stat sbuf;
-  char method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-  char filename[MAXBUF], cgiargs[MAXBUF];
-
-  sscanf(first_line, "%s %s %s", method, uri, version);
-  printf("method:%s uri:%s version:%s\n", method, uri, version);
 
-  if (strcasecmp(method, "GET")) {
-    request_error(fd, method, "501", "Not Implemented",
-                  "server does not implement this method");
-    return;
+    fd_entry_t *file = fd_cache_get(filename);
+    t = stats_lap(STAGE_LOOKUP, t);
+    if (file == NULL) {
+      request_error_conn(fd, keep_alive, filename, "404", "Not found",
+                         "server could not find this file");
+      return keep_alive;
+    }
+    if (file->fd < 0 && (file->error == EMFILE || file->error == ENFILE)) {
+      request_error_conn(fd, keep_alive, filename, "503",
+                         "Service Unavailable",
+                         "server is out of file descriptors");
+      fd_cache_put(file);
+      return keep_alive;
+    }
+    if (file->fd < 0) {
+      request_error_conn(fd, keep_alive, filename, "403", "Forbidden",
+                         "server could not read this file");
+      fd_cache_put(file);
+      return keep_alive;
+    }
+    int rc = request_serve_static(fd, filename, file, keep_alive);
+    fd_cache_put(file);
+    stats_lap(STAGE_SEND, t);
+    return rc < 0 ? 0 : keep_alive;
   }
-  request_read_headers(fd);
 
-  is_static = request_parse_uri(uri, filename, cgiargs);
-  if (stat(filename, &sbuf) < 0) {
-    request_error(fd, filename, "404", "Not found",
-                  "server could not find this file");
-    return;
+  int rc = stat(filename, &sbuf);
+  t = stats_lap(STAGE_LOOKUP, t);
+  if (rc < 0) {
+    request_error_conn(fd, keep_alive, filename, "404", "Not found",
+                       "server could not find this file");
+    return keep_alive;
   }
-
-  if (is_static) {
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-      request_error(fd, filename, "403", "Forbidden",
-                    "server could not read this file");
-      return;
-    }
-    request_serve_static(fd, filename, sbuf.st_size);
-  } else {
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-      request_error(fd, filename, "403", "Forbidden",
-                    "server could not run this CGI program");
-      return;
-    }
-    request_serve_dynamic(fd, filename, cgiargs);
+  if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+    request_error_conn(fd, keep_alive, filename, "403", "Forbidden",
+                       "server could not run this CGI program");
+    return keep_alive;
   }
+  request_serve_dynamic(fd, filename, cgiargs);
+  stats_lap(STAGE_SEND, t);
+  return 0;
 }
@@ -1,7 +1,9 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
-void request_handle_with_first_line(int fd, char *first_line);
+#include "io_helper.h"
+
+int request_handle(rio_t *rp, int allow_keep_alive);
 int request_parse_uri(char *uri, char *filename, char *cgiargs);
 void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 
@@ -0,0 +1,228 @@
+#include "io_helper.h"
+#include "resp_cache.h"
+#include <pthread.h>
+
+#define SHARD_BUCKETS (1024)
+
+typedef struct {
+  resp_entry_t *buckets[SHARD_BUCKETS];
+  resp_entry_t *hand; // CLOCK hand, on a circular list of cached entries
+  size_t bytes;       // bytes of data held by cached entries
+  unsigned long entries;
+  unsigned long hits;
+  unsigned long misses;
+  pthread_mutex_t lock;
+} shard_t;
+
+static shard_t *shards;
+static size_t shard_capacity; // bytes per shard
+
+static unsigned long hash(char *s) {
+  unsigned long h = 5381;
+  int c;
+  while ((c = *s++) != '\0')
+    h = h * 33 + c;
+  return h;
+}
+
+void resp_cache_init(size_t capacity) {
+  shards = calloc(RESP_CACHE_SHARDS, sizeof(shard_t));
+  assert(shards != NULL);
+  for (int i = 0; i < RESP_CACHE_SHARDS; i++)
+    pthread_mutex_init(&shards[i].lock, NULL);
+  shard_capacity = capacity / RESP_CACHE_SHARDS;
+}
+
+int resp_cache_enabled() { return shards != NULL; }
+
+static void entry_free(resp_entry_t *e) {
+  free(e->filename);
+  free(e->data);
+  free(e);
+}
+
+// Drop the cache's reference to an entry (caller holds the shard lock)
+// Returns 1 if that was the last reference and the entry must be freed
+static int remove_entry(shard_t *s, resp_entry_t *e) {
+  resp_entry_t **pp = &s->buckets[hash(e->filename) % SHARD_BUCKETS];
+  while (*pp != e)
+    pp = &(*pp)->hash_next;
+  *pp = e->hash_next;
+
+  if (e->clock_next == e) {
+    s->hand = NULL;
+  } else {
+    e->clock_prev->clock_next = e->clock_next;
+    e->clock_next->clock_prev = e->clock_prev;
+    if (s->hand == e)
+      s->hand = e->clock_next;
+  }
+  e->clock_prev = e->clock_next = NULL;
+
+  s->bytes -= e->head_len + e->body_len;
+  s->entries--;
+  e->cached = 0;
+  return --e->refs == 0;
+}
+
+static resp_entry_t *lookup(shard_t *s, char *filename) {
+  resp_entry_t *e = s->buckets[hash(filename) % SHARD_BUCKETS];
+  while (e && strcmp(e->filename, filename) != 0)
+    e = e->hash_next;
+  return e;
+}
+
+resp_entry_t *resp_cache_get(char *filename) {
+  if (!shards)
+    return NULL;
+  shard_t *s = &shards[hash(filename) % RESP_CACHE_SHARDS];
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&s->lock);
+  resp_entry_t *e = lookup(s, filename);
+  if (e == NULL) {
+    s->misses++;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
+  e->refs++;
+  e->referenced = 1;
+  if (now - e->checked < RESP_CACHE_REVALIDATE) {
+    s->hits++;
+    pthread_mutex_unlock(&s->lock);
+    return e;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  // due for a check (outside the lock)
+  struct stat st;
+  int same = stat(filename, &st) == 0 && fd_cache_same_file(&e->st, &st);
+  int last = 0;
+  pthread_mutex_lock(&s->lock);
+  if (same) {
+    e->checked = now;
+    s->hits++;
+  } else {
+    if (e->cached)
+      remove_entry(s, e); // cannot be the last reference: we hold one
+    last = --e->refs == 0;
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (same)
+    return e;
+  if (last)
+    entry_free(e);
+  return NULL;
+}
+
+resp_entry_t *resp_cache_fill(char *filename, fd_entry_t *file, char *head,
+                              size_t head_len) {
+  if (!shards)
+    return NULL;
+  size_t body_len = file->st.st_size;
+  if (body_len > RESP_CACHE_MAX_OBJECT || head_len + body_len > shard_capacity)
+    return NULL;
+
+  resp_entry_t *e = malloc(sizeof(resp_entry_t));
+  assert(e != NULL);
+  e->data = malloc(head_len + body_len);
+  assert(e->data != NULL);
+  memcpy(e->data, head, head_len);
+  size_t got = 0;
+  while (got < body_len) {
+    ssize_t rc = pread(file->fd, e->data + head_len + got, body_len - got, got);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      break;
+    got += rc;
+  }
+  if (got != body_len) { // file shrank (or broke) while we read it
+    free(e->data);
+    free(e);
+    return NULL;
+  }
+  e->filename = strdup(filename);
+  assert(e->filename != NULL);
+  e->head_len = head_len;
+  e->body_len = body_len;
+  e->st = file->st;
+  e->checked = file->checked;
+  e->refs = 2; // the caller's, and the cache's
+  e->cached = 1;
+  e->referenced = 1;
+
+  shard_t *s = &shards[hash(filename) % RESP_CACHE_SHARDS];
+  resp_entry_t *freed = NULL; // unreferenced victims, freed after unlocking
+  pthread_mutex_lock(&s->lock);
+  resp_entry_t *old = lookup(s, filename);
+  if (old && remove_entry(s, old)) {
+    old->hash_next = freed;
+    freed = old;
+  }
+
+  // CLOCK: sweep the hand, giving referenced entries a second chance,
+  // until the new entry fits
+  while (s->hand && s->bytes + head_len + body_len > shard_capacity) {
+    resp_entry_t *victim = s->hand;
+    if (victim->referenced) {
+      victim->referenced = 0;
+      s->hand = victim->clock_next;
+      continue;
+    }
+    if (remove_entry(s, victim)) {
+      victim->hash_next = freed;
+      freed = victim;
+    }
+  }
+
+  unsigned long b = hash(filename) % SHARD_BUCKETS;
+  e->hash_next = s->buckets[b];
+  s->buckets[b] = e;
+  // insert just behind the hand, so it is the last to be looked at
+  if (s->hand == NULL) {
+    e->clock_prev = e->clock_next = e;
+    s->hand = e;
+  } else {
+    e->clock_next = s->hand;
+    e->clock_prev = s->hand->clock_prev;
+    e->clock_prev->clock_next = e;
+    s->hand->clock_prev = e;
+  }
+  s->bytes += head_len + body_len;
+  s->entries++;
+  pthread_mutex_unlock(&s->lock);
+
+  while (freed) {
+    resp_entry_t *next = freed->hash_next;
+    entry_free(freed);
+    freed = next;
+  }
+  return e;
+}
+
+void resp_cache_put(resp_entry_t *e) {
+  shard_t *s = &shards[hash(e->filename) % RESP_CACHE_SHARDS];
+  pthread_mutex_lock(&s->lock);
+  int last = --e->refs == 0;
+  pthread_mutex_unlock(&s->lock);
+  if (last)
+    entry_free(e);
+}
+
+void resp_cache_stats(resp_cache_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!shards)
+    return;
+  for (int i = 0; i < RESP_CACHE_SHARDS; i++) {
+    shard_t *s = &shards[i];
+    pthread_mutex_lock(&s->lock);
+    stats->hits += s->hits;
+    stats->misses += s->misses;
+    stats->entries += s->entries;
+    stats->bytes += s->bytes;
+    pthread_mutex_unlock(&s->lock);
+  }
+  stats->capacity = shard_capacity * RESP_CACHE_SHARDS;
+}
@@ -0,0 +1,59 @@
+#ifndef __RESP_CACHE_H__
+#define __RESP_CACHE_H__
+
+#include "fd_cache.h"
+
+//
+// In-memory cache of complete static responses (precomputed header + body)
+// for small files, bounded by bytes (wserver -c <MB>). A hit needs no stat(),
+// no header formatting and a single writev(). The table is split into
+// RESP_CACHE_SHARDS independently locked shards, each evicting with CLOCK.
+// Entries are re-checked against the file system like fd_cache entries.
+//
+
+#define RESP_CACHE_SHARDS (16)
+#define RESP_CACHE_MAX_OBJECT (256 * 1024) // largest body worth caching
+#define RESP_CACHE_REVALIDATE (1)          // seconds between file checks
+
+typedef struct resp_entry {
+  char *filename;
+  char *data;      // response header (up to, not including, Connection:),
+                   // immediately followed by the body
+  size_t head_len; // bytes of header at the start of data
+  size_t body_len; // bytes of body after it
+  struct stat st;  // the file the body was read from
+  time_t checked;  // last time st was compared against the file system
+  int refs;        // one per user, plus one while the cache holds it
+  int cached;      // whether the entry is still in the cache
+  int referenced;  // CLOCK bit: used since the hand last passed
+  struct resp_entry *hash_next;
+  struct resp_entry *clock_prev, *clock_next;
+} resp_entry_t;
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long entries;
+  size_t bytes;
+  size_t capacity;
+} resp_cache_stats_t;
+
+// Enable the cache with room for 'capacity' bytes of responses
+// (until then, every lookup misses and nothing is stored)
+void resp_cache_init(size_t capacity);
+int resp_cache_enabled();
+
+// Returns a pinned entry for 'filename', or NULL on a miss
+resp_entry_t *resp_cache_get(char *filename);
+
+// Build an entry from an open file and its precomputed header, and insert
+// it. Returns the pinned entry, or NULL if the file is not cacheable.
+resp_entry_t *resp_cache_fill(char *filename, fd_entry_t *file, char *head,
+                              size_t head_len);
+
+// Unpin an entry returned by resp_cache_get() or resp_cache_fill()
+void resp_cache_put(resp_entry_t *e);
+
+void resp_cache_stats(resp_cache_stats_t *stats);
+
+#endif // __RESP_CACHE_H__
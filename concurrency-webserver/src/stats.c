@@ -0,0 +1,129 @@
+#include "io_helper.h"
+#include "stats.h"
+#include "access_log.h"
+#include "resp_cache.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+static __thread stats_t *mine;
+static stats_t *all;
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long started_us;
+
+static char *stage_names[STAGE_COUNT] = {"accept", "queue", "parse",
+                                         "lookup", "send",  "total"};
+
+void stats_init() { started_us = stats_now_us(); }
+
+long long stats_now_us() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+stats_t *stats_thread() {
+  if (mine)
+    return mine;
+  stats_t *s = malloc(sizeof(stats_t));
+  assert(s != NULL);
+  memset(s, 0, sizeof(*s));
+  for (int i = 0; i < STAGE_COUNT; i++)
+    hist_init(&s->stages[i]);
+  s->worker = -1;
+  // the only lock: once per thread, to publish it for the report
+  pthread_mutex_lock(&all_lock);
+  s->next = all;
+  all = s;
+  pthread_mutex_unlock(&all_lock);
+  return mine = s;
+}
+
+long long stats_lap(int stage, long long since) {
+  long long now = stats_now_us();
+  hist_record(&stats_thread()->stages[stage], now - since);
+  return now;
+}
+
+void stats_response(int status, unsigned long long body_bytes) {
+  stats_t *s = stats_thread();
+  int class = status / 100;
+  if (class >= 1 && class <= 5)
+    s->responses[class]++;
+  s->bytes += body_bytes;
+}
+
+// snprintf() onto the end of what is already in buf (n bytes of it)
+static int appendf(char *buf, int size, int n, char *fmt, ...) {
+  if (n >= size)
+    return n;
+  va_list ap;
+  va_start(ap, fmt);
+  n += vsnprintf(buf + n, size - n, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+int stats_format(char *buf, int size) {
+  long long uptime = stats_now_us() - started_us;
+  unsigned long responses[6] = {0};
+  unsigned long long bytes = 0;
+  long depth = 0;
+  int workers = 0;
+  unsigned long long busy = 0;
+  int n = 0;
+#define OUT(...) n = appendf(buf, size, n, __VA_ARGS__)
+
+  pthread_mutex_lock(&all_lock);
+  stats_t *head = all;
+  pthread_mutex_unlock(&all_lock);
+
+  for (stats_t *s = head; s; s = s->next) {
+    for (int c = 1; c <= 5; c++)
+      responses[c] += s->responses[c];
+    bytes += s->bytes;
+    depth += (long)s->enqueued - (long)s->dequeued;
+    if (s->worker >= 0) {
+      workers++;
+      busy += s->busy_us;
+    }
+  }
+  OUT("uptime_s %.1f\n", uptime / 1e6);
+  OUT("responses %lu\n", responses[1] + responses[2] + responses[3] +
+                             responses[4] + responses[5]);
+  for (int c = 1; c <= 5; c++)
+    OUT("responses_%dxx %lu\n", c, responses[c]);
+  OUT("body_bytes %llu\n", bytes);
+  OUT("queue_depth %ld\n", depth > 0 ? depth : 0);
+  OUT("workers %d\n", workers);
+  OUT("utilization %.3f\n",
+      workers && uptime ? (double)busy / ((double)uptime * workers) : 0.0);
+  for (stats_t *s = head; s; s = s->next)
+    if (s->worker >= 0)
+      OUT("worker_utilization{%d} %.3f\n", s->worker,
+          uptime ? (double)s->busy_us / uptime : 0.0);
+
+  resp_cache_stats_t cache;
+  resp_cache_stats(&cache);
+  OUT("cache_hits %lu\ncache_misses %lu\ncache_entries %lu\n"
+      "cache_bytes %zu\ncache_capacity %zu\n",
+      cache.hits, cache.misses, cache.entries, cache.bytes, cache.capacity);
+  OUT("log_dropped %lu\n", access_log_dropped());
+
+  OUT("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "stage_us", "count",
+      "mean", "p50", "p90", "p99", "p99.9", "max");
+  histogram_t *h = malloc(sizeof(histogram_t));
+  assert(h != NULL);
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    hist_init(h);
+    for (stats_t *s = head; s; s = s->next)
+      hist_merge(h, &s->stages[i]);
+    OUT("%-8s %10lu %10.1f %10llu %10llu %10llu %10llu %10llu\n",
+        stage_names[i], h->total, hist_mean(h), hist_percentile(h, 50),
+        hist_percentile(h, 90), hist_percentile(h, 99),
+        hist_percentile(h, 99.9), h->total ? h->max : 0);
+  }
+  free(h);
+#undef OUT
+  return n < size ? n : size - 1;
+}
@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "histogram.h"
+
+//
+// Server metrics: every thread that handles connections gets its own
+// counters and per-stage latency histograms (microseconds), written only by
+// that thread without locks or atomics. GET /__stats sums them up; readers
+// do not lock either, so a report may be a few requests out of date.
+//
+
+enum {
+  STAGE_ACCEPT, // accept() to the first request being queued (epoll mode:
+                // includes waiting for the request header)
+  STAGE_QUEUE,  // waiting in the request queue for a worker
+  STAGE_PARSE,  // reading and parsing the request line and headers
+  STAGE_LOOKUP, // cache lookups / stat() of the file
+  STAGE_SEND,   // sending the response (CGI: starting the program)
+  STAGE_TOTAL,  // queued (or read, for later keep-alive requests) to sent
+  STAGE_COUNT
+};
+
+typedef struct stats {
+  histogram_t stages[STAGE_COUNT];
+  unsigned long responses[6];  // by status class (responses[2]: 2xx, ...)
+  unsigned long long bytes;    // response bodies sent
+  unsigned long enqueued;      // requests this thread put in a queue
+  unsigned long dequeued;      // requests this thread took out of one
+  unsigned long long busy_us;  // time spent serving requests
+  int worker;                  // worker thread index, or -1
+  struct stats *next;          // all threads' stats
+} stats_t;
+
+// Start the clock for uptime and utilization
+void stats_init();
+
+long long stats_now_us();
+
+// The calling thread's stats (created on first use)
+stats_t *stats_thread();
+
+// Record a stage that began at 'since'; returns the current time, so that
+// consecutive stages can be timed as laps
+long long stats_lap(int stage, long long since);
+
+// Count a response sent by this thread
+void stats_response(int status, unsigned long long body_bytes);
+
+// Write a plain-text report into 'buf'; returns its length
+int stats_format(char *buf, int size);
+
+#endif // __STATS_H__
@@ -1,9 +1,12 @@
 
 #include "io_helper.h"
+#include "histogram.h"
 #include <pthread.h>
 #include <getopt.h>
+#include <time.h>
 
 #define MAXBUF (8192)
+#define BENCH_MAX_URIS (1024)
 
 // Thread arguments structure
 typedef struct {
@@ -22,8 +25,10 @@ void client_send(int fd, char *filename) {
   gethostname_or_die(hostname, MAXBUF);
 
   /* Form and send the HTTP request */
+  /* (one request per connection: client_print() reads until EOF, so ask
+     the server not to keep the connection open) */
   sprintf(buf, "GET %s HTTP/1.1\n", filename);
-  sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
+  sprintf(buf, "%shost: %s\nConnection: close\n\r\n", buf, hostname);
   write_or_die(fd, buf, strlen(buf));
 }
 
@@ -33,12 +38,15 @@ void client_send(int fd, char *filename) {
 void client_print(int fd) {
   char buf[MAXBUF];
   int n;
+  rio_t rio;
+
+  rio_init(&rio, fd);
 
   // Read and display the HTTP Header
-  n = readline_or_die(fd, buf, MAXBUF);
+  n = rio_readline_or_die(&rio, buf, MAXBUF);
   while (strcmp(buf, "\r\n") && (n > 0)) {
     printf("Header: %s", buf);
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
 
     // If you want to look for certain HTTP tags...
     // int length = 0;
@@ -48,10 +56,10 @@ void client_print(int fd) {
   }
 
   // Read and display the HTTP Body
-  n = readline_or_die(fd, buf, MAXBUF);
+  n = rio_readline_or_die(&rio, buf, MAXBUF);
   while (n > 0) {
     printf("%s", buf);
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
   }
 }
 
@@ -73,18 +81,313 @@ void *client_thread(void *arg) {
   return NULL;
 }
 
+//
+// Benchmark mode: -n threads each run a closed loop of requests, drawn from
+// a weighted URI mix, for -d seconds or until -N requests are done.
+// Bodies are read and thrown away; latencies (microseconds, from connect
+// or request sent to the last body byte) go into per-thread histograms.
+//
+
+typedef struct {
+  char *uri;
+  double weight; // relative frequency
+} bench_uri_t;
+
+typedef struct {
+  histogram_t latency;
+  unsigned long non2xx; // complete responses with another status
+  unsigned long errors; // connections that failed mid-request
+  unsigned long long bytes;
+} bench_stats_t;
+
+bench_uri_t bench_uris[BENCH_MAX_URIS];
+double bench_cumulative[BENCH_MAX_URIS]; // running sum of weights
+int bench_num_uris = 0;
+struct sockaddr_in bench_addr;
+char bench_host[MAXBUF];
+int bench_keep_alive = 0;
+double bench_deadline = 0; // monotonic seconds (0: no time limit)
+long bench_requests = 0;   // total to send (0: no count limit)
+long bench_issued = 0;     // requests claimed so far (atomic)
+
+double now_seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Read a URI mix: one "[weight] uri" per line (weight defaults to 1),
+// '#' starts a comment
+void bench_load_uris(char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error: cannot open %s\n", path);
+    exit(1);
+  }
+  char line[MAXBUF], a[MAXBUF], b[MAXBUF];
+  while (fgets(line, MAXBUF, f) != NULL) {
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    int n = sscanf(line, "%s %s", a, b);
+    if (n <= 0)
+      continue;
+    if (bench_num_uris == BENCH_MAX_URIS) {
+      fprintf(stderr, "Error: more than %d URIs in %s\n", BENCH_MAX_URIS, path);
+      exit(1);
+    }
+    bench_uri_t *u = &bench_uris[bench_num_uris++];
+    u->weight = n == 2 ? atof(a) : 1.0;
+    u->uri = strdup(n == 2 ? b : a);
+    if (u->weight <= 0) {
+      fprintf(stderr, "Error: weight of %s must be positive\n", u->uri);
+      exit(1);
+    }
+  }
+  fclose(f);
+}
+
+void bench_add_uri(char *uri) {
+  bench_uris[bench_num_uris].uri = uri;
+  bench_uris[bench_num_uris].weight = 1.0;
+  bench_num_uris++;
+}
+
+// Pick a URI index according to the weights
+int bench_pick(unsigned int *seed) {
+  double x = rand_r(seed) / ((double)RAND_MAX + 1) *
+             bench_cumulative[bench_num_uris - 1];
+  int lo = 0, hi = bench_num_uris - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (bench_cumulative[mid] > x)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+// Whether this thread should send another request
+int bench_more() {
+  if (bench_deadline > 0 && now_seconds() >= bench_deadline)
+    return 0;
+  if (bench_requests > 0 &&
+      __atomic_fetch_add(&bench_issued, 1, __ATOMIC_RELAXED) >= bench_requests)
+    return 0;
+  return 1;
+}
+
+int bench_connect() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (sockaddr_t *)&bench_addr, sizeof(bench_addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Send one request and read (and drop) its response.
+// Returns the HTTP status, or -1 if the connection failed; *reuse says
+// whether the connection can carry another request
+int bench_request(int fd, rio_t *rio, char *uri, unsigned long long *bytes,
+                  int *reuse) {
+  char buf[MAXBUF];
+  int n = snprintf(buf, MAXBUF,
+                   "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", uri,
+                   bench_host, bench_keep_alive ? "keep-alive" : "close");
+  if (writen(fd, buf, n) < 0)
+    return -1;
+
+  int status = 0;
+  if (rio_readline(rio, buf, MAXBUF) <= 0 ||
+      sscanf(buf, "HTTP/%*s %d", &status) != 1)
+    return -1;
+  long length = -1;
+  int close_after = !bench_keep_alive;
+  while (1) {
+    if (rio_readline(rio, buf, MAXBUF) <= 0)
+      return -1;
+    if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0)
+      break;
+    if (strncasecmp(buf, "Content-Length:", 15) == 0)
+      length = atol(buf + 15);
+    else if (strncasecmp(buf, "Connection:", 11) == 0 &&
+             strcasestr(buf + 11, "close") != NULL)
+      close_after = 1;
+  }
+
+  // the body: Content-Length bytes, or everything up to EOF
+  long left = length;
+  while (length < 0 || left > 0) {
+    size_t want = length < 0 || left > MAXBUF ? MAXBUF : left;
+    ssize_t rc = rio_readn(rio, buf, want);
+    if (rc < 0 || (rc == 0 && length >= 0))
+      return -1;
+    if (rc == 0)
+      break;
+    *bytes += rc;
+    left -= rc;
+  }
+  *reuse = !close_after && length >= 0;
+  return status;
+}
+
+void *bench_thread(void *arg) {
+  bench_stats_t *stats = arg; // one per URI
+  unsigned int seed = (unsigned int)(uintptr_t)arg ^ (unsigned int)time(NULL);
+  int fd = -1;
+  rio_t rio;
+
+  while (bench_more()) {
+    int i = bench_pick(&seed);
+    double start = now_seconds();
+    if (fd < 0) {
+      if ((fd = bench_connect()) < 0) {
+        stats[i].errors++;
+        continue;
+      }
+      rio_init(&rio, fd);
+    }
+    int reuse = 0;
+    int status = bench_request(fd, &rio, bench_uris[i].uri, &stats[i].bytes,
+                               &reuse);
+    if (status < 0) {
+      stats[i].errors++;
+    } else {
+      hist_record(&stats[i].latency,
+                  (unsigned long long)((now_seconds() - start) * 1e6));
+      if (status < 200 || status > 299)
+        stats[i].non2xx++;
+    }
+    if (status < 0 || !reuse) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+void bench_print_row(char *name, bench_stats_t *s) {
+  histogram_t *h = &s->latency;
+  printf("%-24s %9lu %7lu %7lu %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+         h->total, s->non2xx, s->errors, hist_mean(h) / 1000,
+         hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+         hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0,
+         h->max / 1000.0);
+}
+
+void bench_run(char *host, int port, int num_threads) {
+  struct hostent *hp = gethostbyname(host);
+  if (hp == NULL) {
+    fprintf(stderr, "Error: unknown host %s\n", host);
+    exit(1);
+  }
+  bzero(&bench_addr, sizeof(bench_addr));
+  bench_addr.sin_family = AF_INET;
+  bcopy(hp->h_addr, &bench_addr.sin_addr.s_addr, hp->h_length);
+  bench_addr.sin_port = htons(port);
+  gethostname_or_die(bench_host, MAXBUF);
+  signal(SIGPIPE, SIG_IGN);
+
+  double sum = 0;
+  for (int i = 0; i < bench_num_uris; i++) {
+    sum += bench_uris[i].weight;
+    bench_cumulative[i] = sum;
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  bench_stats_t *stats = malloc(sizeof(bench_stats_t) * num_threads *
+                                bench_num_uris);
+  if (!threads || !stats) {
+    fprintf(stderr, "Error: failed to allocate memory for threads\n");
+    exit(1);
+  }
+  for (int i = 0; i < num_threads * bench_num_uris; i++) {
+    hist_init(&stats[i].latency);
+    stats[i].non2xx = stats[i].errors = stats[i].bytes = 0;
+  }
+
+  double start = now_seconds();
+  if (bench_deadline > 0)
+    bench_deadline += start;
+  for (int t = 0; t < num_threads; t++) {
+    if (pthread_create(&threads[t], NULL, bench_thread,
+                       &stats[t * bench_num_uris]) != 0) {
+      fprintf(stderr, "Error: failed to create thread %d\n", t);
+      exit(1);
+    }
+  }
+  for (int t = 0; t < num_threads; t++)
+    pthread_join(threads[t], NULL);
+  double elapsed = now_seconds() - start;
+
+  // fold every thread's numbers into the first thread's, and a total
+  bench_stats_t total;
+  hist_init(&total.latency);
+  total.non2xx = total.errors = total.bytes = 0;
+  for (int i = 0; i < bench_num_uris; i++) {
+    bench_stats_t *s = &stats[i];
+    for (int t = 1; t < num_threads; t++) {
+      bench_stats_t *o = &stats[t * bench_num_uris + i];
+      hist_merge(&s->latency, &o->latency);
+      s->non2xx += o->non2xx;
+      s->errors += o->errors;
+      s->bytes += o->bytes;
+    }
+    hist_merge(&total.latency, &s->latency);
+    total.non2xx += s->non2xx;
+    total.errors += s->errors;
+    total.bytes += s->bytes;
+  }
+
+  printf("%d threads, %s, %.2f s: %.1f requests/s, %.2f MB/s\n", num_threads,
+         bench_keep_alive ? "keep-alive" : "one request per connection",
+         elapsed, total.latency.total / elapsed,
+         total.bytes / elapsed / (1024 * 1024));
+  printf("%-24s %9s %7s %7s %9s %9s %9s %9s %9s %9s\n", "latency (ms)",
+         "requests", "non2xx", "errors", "mean", "p50", "p90", "p99", "p99.9",
+         "max");
+  bench_print_row("all", &total);
+  if (bench_num_uris > 1)
+    for (int i = 0; i < bench_num_uris; i++)
+      bench_print_row(bench_uris[i].uri, &stats[i]);
+
+  free(threads);
+  free(stats);
+}
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s [-n <num_threads>] <host> <port> <filename>\n",
+          prog);
+  fprintf(stderr,
+          "   or: %s [-n <num_threads>] [-d <secs> | -N <requests>] [-k] "
+          "[-f <uri_file>] <host> <port> [<filename>]\n",
+          prog);
+  fprintf(stderr, "  -n: number of concurrent threads (default: 1)\n");
+  fprintf(stderr, "  -d: benchmark for this many seconds\n");
+  fprintf(stderr, "  -N: benchmark until this many requests are done\n");
+  fprintf(stderr, "  -k: benchmark with keep-alive connections\n");
+  fprintf(stderr, "  -f: benchmark a mix of URIs, one \"[weight] uri\" per "
+                  "line\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
   char *host, *filename;
   int port;
   int num_threads = 1;  // Default to 1 thread for backward compatibility
   int c;
-  int host_idx = -1, port_idx = -1, filename_idx = -1;
 
-  // First, try to parse -n option if it appears before positional arguments
-  opterr = 0;  // Suppress getopt error messages
-  optind = 1;  // Reset optind
-  
-  while ((c = getopt(argc, argv, "n:")) != -1) {
+  int bench = 0;
+  char *uri_file = NULL;
+
+  // (options may also follow the positional arguments)
+  while ((c = getopt(argc, argv, "n:d:N:kf:")) != -1) {
     switch (c) {
     case 'n':
       num_threads = atoi(optarg);
@@ -93,39 +396,57 @@ int main(int argc, char *argv[]) {
         exit(1);
       }
       break;
-    case '?':
+    case 'd':
+      bench = 1;
+      bench_deadline = atof(optarg);
+      if (bench_deadline <= 0) {
+        fprintf(stderr, "Error: duration must be positive\n");
+        exit(1);
+      }
       break;
-    default:
+    case 'N':
+      bench = 1;
+      bench_requests = atol(optarg);
+      if (bench_requests <= 0) {
+        fprintf(stderr, "Error: number of requests must be positive\n");
+        exit(1);
+      }
       break;
+    case 'k':
+      bench = 1;
+      bench_keep_alive = 1;
+      break;
+    case 'f':
+      bench = 1;
+      uri_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
     }
   }
+  int host_idx = optind, port_idx = optind + 1, filename_idx = optind + 2;
 
-  // Now manually scan all arguments to find -n if it appears after positional args
-  // and also find the positional arguments
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
-      num_threads = atoi(argv[i + 1]);
-      if (num_threads <= 0) {
-        fprintf(stderr, "Error: number of threads must be positive\n");
-        exit(1);
-      }
-      i++;  // Skip the next argument (the number)
-    } else if (argv[i][0] != '-' && host_idx == -1) {
-      host_idx = i;
-    } else if (argv[i][0] != '-' && host_idx != -1 && port_idx == -1) {
-      port_idx = i;
-    } else if (argv[i][0] != '-' && port_idx != -1 && filename_idx == -1) {
-      filename_idx = i;
+  if (bench) {
+    if (argc - optind < 2 || argc - optind > 3 ||
+        (uri_file == NULL) == (argc - optind == 2))
+      usage(argv[0]); // exactly one of a URI file and a filename
+    if (uri_file)
+      bench_load_uris(uri_file);
+    else
+      bench_add_uri(argv[filename_idx]);
+    if (bench_num_uris == 0) {
+      fprintf(stderr, "Error: no URIs in %s\n", uri_file);
+      exit(1);
     }
+    if (bench_deadline == 0 && bench_requests == 0)
+      bench_deadline = 10;
+    bench_run(argv[host_idx], atoi(argv[port_idx]), num_threads);
+    exit(0);
   }
 
   // Check if we found all required positional arguments
-  if (host_idx == -1 || port_idx == -1 || filename_idx == -1) {
-    fprintf(stderr, "Usage: %s <host> <port> <filename> [-n <num_threads>]\n", argv[0]);
-    fprintf(stderr, "   or: %s -n <num_threads> <host> <port> <filename>\n", argv[0]);
-    fprintf(stderr, "  -n: number of concurrent threads (default: 1)\n");
-    exit(1);
-  }
+  if (argc - optind != 3)
+    usage(argv[0]);
 
   host = argv[host_idx];
   port = atoi(argv[port_idx]);
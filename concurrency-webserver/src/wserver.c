@@ -1,50 +1,141 @@
 #include "io_helper.h"
 #include "request.h"
+#include "fd_cache.h"
+#include "resp_cache.h"
+#include "access_log.h"
+#include "stats.h"
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 char default_root[] = ".";
 
+// Connection structure (lives across keep-alive requests)
+typedef struct conn {
+  int fd;
+  int shard;                // Acceptor (and queue/poller shard) it came from
+  int num_requests;         // Requests served on this connection so far
+  int in_poller;            // Whether fd has been registered with the poller
+  time_t deadline;          // When the poller gives up waiting for a request
+  long long accepted_us;    // When it was accepted (stats_now_us())
+  struct conn *prev, *next; // Poller's list of waiting connections
+  rio_t rio;                // Connection reader (bytes already read off fd)
+} conn_t;
+
 // Request structure
 typedef struct {
-  int fd;
-  off_t file_size;       // For SFF scheduling
-  char first_line[8192]; // For SFF scheduling (first line already read)
-  int has_first_line;    // Whether first_line is valid
+  conn_t *conn;
+  off_t file_size;        // For SFF scheduling
+  long long priority;     // SFF heap key (smaller runs first)
+  unsigned long long seq; // Arrival order, breaks priority ties
+  long long queued_us;    // When it was queued (stats_now_us())
 } request_t;
 
 // Request queue structure
+// FIFO: circular buffer (front/rear). SFF: binary min-heap on
+// (priority, seq) in requests[0..count-1]
 typedef struct {
   request_t *requests;
   int size;
   int count;
   int front;
   int rear;
+  int heap;                    // Whether this is a priority queue
+  unsigned long long next_seq; // Sequence number of the next insertion
   pthread_mutex_t mutex;
   pthread_cond_t not_full;
   pthread_cond_t not_empty;
   int shutdown;
 } request_queue_t;
 
+// Work-stealing pool (-w, FIFO only): one bounded lock-free MPMC ring per
+// worker instead of the single locked queue. dispatch() deals connections out
+// round-robin; a worker serves its own ring first and steals from its
+// neighbours' when that is empty. 'slots' bounds the requests queued across
+// all rings to -b (backpressure, as with the single queue), and 'items' lets
+// idle workers sleep
+typedef struct {
+  unsigned long seq; // Ring position this cell is ready for (see ring_push)
+  request_t req;
+} ring_cell_t;
+
+typedef struct {
+  ring_cell_t *cells;
+  unsigned long mask; // capacity - 1 (capacity is a power of 2)
+  // Consumers and producers each get their own cache line
+  unsigned long head __attribute__((aligned(64))); // Next position to take
+  unsigned long tail __attribute__((aligned(64))); // Next position to fill
+} __attribute__((aligned(64))) ring_t;
+
+typedef struct {
+  ring_t *rings;
+  int num_rings;
+  unsigned long next; // Round-robin cursor for dispatch
+  sem_t slots;        // Free queue entries (-b in total)
+  sem_t items;        // Queued requests
+  int shutdown;
+} steal_pool_t;
+
+// Connection poller: connections wait here (not on a worker) until a complete
+// request header has been buffered, or their deadline passes. Idle keep-alive
+// connections always come back here; in epoll mode new connections start here
+typedef struct {
+  int epoll_fd;
+  int listen_fd;     // Accepted from in epoll mode (-1 otherwise)
+  int shard;         // Which acceptor this poller belongs to
+  conn_t *idle_head; // Waiting connections
+  conn_t *idle_tail;
+  pthread_mutex_t mutex;
+} poller_t;
+
 // Global variables
-request_queue_t *queue;
+// Each acceptor (-a) has its own listening socket, queue and poller: a shard.
+// Worker i serves queue shard i % num_acceptors
+int *listen_fds;
+request_queue_t **queues;
+steal_pool_t *pool; // Replaces 'queues' with -w (shared by all shards)
+poller_t **pollers;
 int num_threads = 1;
 int buffer_size = 1;
 char *schedalg = "FIFO";
+char *mode = "thread";     // Front end: blocking acceptor or epoll event loop
+int keepalive_timeout = 5; // Seconds an idle connection is kept (0: disabled)
+int max_requests = 100;    // Requests served per connection before closing
+int cache_mb = 0;          // Response cache size in MB (0: disabled)
+int work_stealing = 0;     // Per-worker rings instead of one shared queue
+int pin_cpus = 0;          // Pin each worker thread to its own CPU
+int num_acceptors = 1;     // SO_REUSEPORT listeners, one acceptor each
+int log_mode = LOG_SYNC;   // Per-request log lines on stdout
+int sff_age_max_delay = 5; // Seconds SFF-AGE may hold back a large file
+
+// Seconds a new connection (epoll mode) may take to send its request header
+#define REQUEST_TIMEOUT (10)
+
+// SFF-AGE: a request for a file of N bytes is ordered as if it had arrived
+// N / SFF_AGE_RATE seconds later than it did (but at most -g seconds), so
+// small files still go first but a large one is passed over for a bounded
+// time only
+#define SFF_AGE_RATE (10 * 1024 * 1024) // bytes per second of waiting
 
 // Initialize request queue
-request_queue_t *queue_init(int size) {
+request_queue_t *queue_init(int size, int heap) {
   request_queue_t *q = malloc(sizeof(request_queue_t));
   q->requests = malloc(sizeof(request_t) * size);
   q->size = size;
   q->count = 0;
   q->front = 0;
   q->rear = 0;
+  q->heap = heap;
+  q->next_seq = 0;
   q->shutdown = 0;
   pthread_mutex_init(&q->mutex, NULL);
   pthread_cond_init(&q->not_full, NULL);
@@ -78,7 +169,13 @@ void queue_insert_fifo(request_queue_t *q, request_t req) {
   pthread_mutex_unlock(&q->mutex);
 }
 
-// Insert request into queue (SFF - sorted by file size)
+// Heap order: smaller priority first, then earlier arrival
+static int request_before(request_t *a, request_t *b) {
+  return a->priority < b->priority ||
+         (a->priority == b->priority && a->seq < b->seq);
+}
+
+// Insert request into queue (SFF - heap ordered by req.priority)
 void queue_insert_sff(request_queue_t *q, request_t req) {
   pthread_mutex_lock(&q->mutex);
   while (q->count == q->size && !q->shutdown) {
@@ -89,50 +186,45 @@ void queue_insert_sff(request_queue_t *q, request_t req) {
     return;
   }
 
-  // Insert in sorted order (smallest file first)
-  if (q->count == 0) {
-    q->requests[q->rear] = req;
-    q->rear = (q->rear + 1) % q->size;
-  } else {
-    // Find insertion point (first position where file_size > req.file_size)
-    int insert_pos = q->rear; // Default: insert at end
-    int i;
-    for (i = 0; i < q->count; i++) {
-      int pos = (q->front + i) % q->size;
-      if (q->requests[pos].file_size > req.file_size) {
-        insert_pos = pos;
-        break;
-      }
-    }
-
-    // Shift elements to make room for insertion
-    if (insert_pos == q->rear) {
-      // Insert at end (no shifting needed)
-      q->requests[q->rear] = req;
-      q->rear = (q->rear + 1) % q->size;
-    } else {
-      // Insert in middle: shift elements from insert_pos to rear-1
-      // Move rear to make room
-      int current = q->rear;
-
-      // Shift elements backward (toward rear)
-      while (current != insert_pos) {
-        int prev = (current - 1 + q->size) % q->size;
-        q->requests[current] = q->requests[prev];
-        current = prev;
-      }
-
-      // Insert new element
-      q->requests[insert_pos] = req;
-      q->rear = (q->rear + 1) % q->size;
-    }
+  // Sift up from the new last leaf: O(log n) moves under the lock
+  req.seq = q->next_seq++;
+  int pos = q->count++;
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (!request_before(&req, &q->requests[parent]))
+      break;
+    q->requests[pos] = q->requests[parent];
+    pos = parent;
   }
+  q->requests[pos] = req;
 
-  q->count++;
   pthread_cond_signal(&q->not_empty);
   pthread_mutex_unlock(&q->mutex);
 }
 
+// Take the smallest request off the heap (caller holds q->mutex)
+static request_t heap_pop(request_queue_t *q) {
+  request_t top = q->requests[0];
+  request_t last = q->requests[--q->count];
+  // Sift the last leaf down from the root
+  int pos = 0;
+  while (1) {
+    int child = 2 * pos + 1;
+    if (child >= q->count)
+      break;
+    if (child + 1 < q->count &&
+        request_before(&q->requests[child + 1], &q->requests[child]))
+      child++;
+    if (!request_before(&q->requests[child], &last))
+      break;
+    q->requests[pos] = q->requests[child];
+    pos = child;
+  }
+  if (q->count > 0)
+    q->requests[pos] = last;
+  return top;
+}
+
 // Remove request from queue
 request_t queue_remove(request_queue_t *q) {
   pthread_mutex_lock(&q->mutex);
@@ -140,29 +232,138 @@ request_t queue_remove(request_queue_t *q) {
     pthread_cond_wait(&q->not_empty, &q->mutex);
   }
 
-  request_t req = {-1, 0};
+  request_t req = {NULL, 0, 0, 0, 0};
   if (q->shutdown && q->count == 0) {
     pthread_mutex_unlock(&q->mutex);
     return req;
   }
 
-  req = q->requests[q->front];
-  q->front = (q->front + 1) % q->size;
-  q->count--;
+  if (q->heap) {
+    req = heap_pop(q);
+  } else {
+    req = q->requests[q->front];
+    q->front = (q->front + 1) % q->size;
+    q->count--;
+  }
   pthread_cond_signal(&q->not_full);
   pthread_mutex_unlock(&q->mutex);
   return req;
 }
 
+// Initialize a ring with room for at least 'size' requests
+void ring_init(ring_t *r, int size) {
+  unsigned long capacity = 1;
+  while (capacity < (unsigned long)size)
+    capacity *= 2;
+  r->cells = malloc(sizeof(ring_cell_t) * capacity);
+  assert(r->cells != NULL);
+  for (unsigned long i = 0; i < capacity; i++)
+    r->cells[i].seq = i;
+  r->mask = capacity - 1;
+  r->head = r->tail = 0;
+}
+
+// Bounded MPMC ring (Vyukov): a cell's seq equals the position that may be
+// filled next, and position + 1 once it holds a request for that position.
+// Producers and consumers each claim a position with one CAS.
+// Returns 0 if the ring is full
+int ring_push(ring_t *r, request_t *req) {
+  unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  while (1) {
+    ring_cell_t *cell = &r->cells[pos & r->mask];
+    unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)(seq - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->req = *req;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+      // lost the race: pos now holds the current tail
+    } else if (diff < 0) {
+      return 0; // still holds the request from a lap ago
+    } else {
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Returns 0 if the ring is empty
+int ring_pop(ring_t *r, request_t *req) {
+  unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  while (1) {
+    ring_cell_t *cell = &r->cells[pos & r->mask];
+    unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)(seq - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *req = cell->req;
+        // free the cell for the producer one lap ahead
+        __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // not filled yet
+    } else {
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Initialize a work-stealing pool of 'workers' rings, 'size' requests total
+steal_pool_t *pool_init(int workers, int size) {
+  steal_pool_t *p = malloc(sizeof(steal_pool_t));
+  assert(p != NULL);
+  p->rings = aligned_alloc(64, sizeof(ring_t) * workers);
+  assert(p->rings != NULL);
+  // each ring can hold all of -b, so a push never finds its ring full
+  for (int i = 0; i < workers; i++)
+    ring_init(&p->rings[i], size);
+  p->num_rings = workers;
+  p->next = 0;
+  sem_init(&p->slots, 0, size);
+  sem_init(&p->items, 0, 0);
+  p->shutdown = 0;
+  return p;
+}
+
+// Insert request into the next worker's ring (blocks while -b are queued)
+void pool_insert(steal_pool_t *p, request_t req) {
+  while (sem_wait(&p->slots) < 0)
+    assert(errno == EINTR);
+  unsigned long i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+  while (!ring_push(&p->rings[i % p->num_rings], &req))
+    i++;
+  sem_post(&p->items);
+}
+
+// Remove a request for worker 'self': from its own ring if it has one,
+// else stolen from the nearest neighbour that does
+request_t pool_remove(steal_pool_t *p, int self) {
+  request_t req = {NULL, 0, 0, 0, 0};
+  while (sem_wait(&p->items) < 0)
+    assert(errno == EINTR);
+  if (p->shutdown)
+    return req;
+  // holding an 'items' token guarantees some ring has a request for us
+  for (int i = 0; !ring_pop(&p->rings[(self + i) % p->num_rings], &req); i++)
+    ;
+  sem_post(&p->slots);
+  return req;
+}
+
 // Get file size for a request (for SFF scheduling)
-// Returns file size, and stores first_line in the provided buffer
-off_t get_file_size(int fd, char *first_line_buf) {
+// Only peeks at the request line: it stays buffered in 'rio' for the worker
+off_t get_file_size(rio_t *rio) {
+  char first_line_buf[8192];
   char method[8192], uri[8192], version[8192];
   char filename[8192], cgiargs[8192];
   struct stat sbuf;
 
-  // Read the request line
-  ssize_t n = readline(fd, first_line_buf, 8192);
+  // Peek at the request line
+  ssize_t n = rio_peekline(rio, first_line_buf, 8192);
   if (n <= 0) {
     return -1;
   }
@@ -181,20 +382,291 @@ off_t get_file_size(int fd, char *first_line_buf) {
   return sbuf.st_size;
 }
 
-// Worker thread function
+conn_t *conn_new(int fd, int shard) {
+  conn_t *conn = malloc(sizeof(conn_t));
+  assert(conn != NULL);
+  conn->fd = fd;
+  conn->shard = shard;
+  conn->num_requests = 0;
+  conn->in_poller = 0;
+  conn->accepted_us = stats_now_us();
+  conn->prev = conn->next = NULL;
+  rio_init(&conn->rio, fd);
+  return conn;
+}
+
+void conn_close(conn_t *conn) {
+  close_or_die(conn->fd);
+  free(conn);
+}
+
+// Hand a connection to the worker pool, according to the scheduling policy
+void dispatch(conn_t *conn) {
+  request_t req;
+  req.conn = conn;
+  req.queued_us = stats_now_us();
+  if (conn->num_requests == 0)
+    stats_lap(STAGE_ACCEPT, conn->accepted_us);
+  stats_thread()->enqueued++;
+
+  if (strcmp(schedalg, "FIFO") != 0) {
+    // For SFF, need to get file size first
+    // This peeks at the first line; the worker reads it again from 'rio'
+    req.file_size = get_file_size(&conn->rio);
+    if (req.file_size < 0) {
+      // If we can't read the request line, treat as error
+      // (on a reused connection this is just the client hanging up)
+      if (conn->num_requests == 0)
+        request_error(conn->fd, "", "400", "Bad Request",
+                      "Could not read request");
+      stats_thread()->dequeued++; // never queued after all
+      conn_close(conn);
+      return;
+    }
+    req.priority = req.file_size;
+    if (strcmp(schedalg, "SFF-AGE") == 0) {
+      // the key is a (virtual) deadline: arrival time plus a size penalty
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double delay = (double)req.file_size / SFF_AGE_RATE;
+      if (delay > sff_age_max_delay)
+        delay = sff_age_max_delay;
+      req.priority = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000 +
+                     (long long)(delay * 1e6);
+    }
+    queue_insert_sff(queues[conn->shard], req);
+  } else {
+    // FIFO scheduling
+    req.file_size = 0; // Not used for FIFO
+    req.priority = 0;
+    if (pool)
+      pool_insert(pool, req);
+    else
+      queue_insert_fifo(queues[conn->shard], req);
+  }
+}
+
+// Initialize connection poller
+poller_t *poller_init(int listen_fd, int shard) {
+  poller_t *p = malloc(sizeof(poller_t));
+  assert(p != NULL);
+  p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  assert(p->epoll_fd >= 0);
+  p->listen_fd = listen_fd;
+  p->shard = shard;
+  if (listen_fd >= 0) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // marks the listening socket
+    int rc = fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    assert(rc == 0);
+    rc = epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    assert(rc == 0);
+  }
+  p->idle_head = p->idle_tail = NULL;
+  pthread_mutex_init(&p->mutex, NULL);
+  return p;
+}
+
+// Unlink a connection from the waiting list (caller holds p->mutex)
+void poller_unlink(poller_t *p, conn_t *conn) {
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    p->idle_head = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  else
+    p->idle_tail = conn->prev;
+  conn->prev = conn->next = NULL;
+}
+
+// (Re-)arm a waiting connection's descriptor
+void poller_arm(poller_t *p, conn_t *conn) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  // ONESHOT: the fd is disarmed once it fires, so re-arm with MOD
+  int op = conn->in_poller ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  conn->in_poller = 1;
+  int rc = epoll_ctl(p->epoll_fd, op, conn->fd, &ev);
+  assert(rc == 0);
+}
+
+// Park a connection until its next request header arrives, for up to
+// 'timeout' seconds. After this call the connection belongs to the poller
+void poller_add(poller_t *p, conn_t *conn, int timeout) {
+  pthread_mutex_lock(&p->mutex);
+  conn->deadline = time(NULL) + timeout;
+  conn->prev = p->idle_tail;
+  conn->next = NULL;
+  if (p->idle_tail)
+    p->idle_tail->next = conn;
+  else
+    p->idle_head = conn;
+  p->idle_tail = conn;
+  poller_arm(p, conn);
+  pthread_mutex_unlock(&p->mutex);
+}
+
+// Buffer whatever request bytes have arrived, without blocking.
+// Returns 1 once a complete request header is buffered, 0 if more is still
+// to come, -1 if the connection should be dropped
+int conn_fill(conn_t *conn) {
+  ssize_t rc = rio_fill_nonblock(&conn->rio);
+  if (rc > 0 && rio_has_header(&conn->rio))
+    return 1;
+  if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                  errno != ENOBUFS))
+    return -1;
+  if (conn->rio.cnt == RIO_BUFSIZE) {
+    request_error(conn->fd, "", "400", "Bad Request",
+                  "request header too large");
+    return -1;
+  }
+  return 0;
+}
+
+// Accept every pending connection on the (non-blocking) listening socket
+void poller_accept(poller_t *p) {
+  while (1) {
+    int conn_fd =
+        accept4(p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd < 0 && errno == EINTR)
+      continue;
+    if (conn_fd < 0)
+      return; // EAGAIN: drained (anything else: retry on the next wakeup)
+
+    // the request line often arrives together with the connection
+    conn_t *conn = conn_new(conn_fd, p->shard);
+    int rc = conn_fill(conn);
+    if (rc > 0)
+      dispatch(conn);
+    else if (rc < 0)
+      conn_close(conn);
+    else
+      poller_add(p, conn, REQUEST_TIMEOUT);
+  }
+}
+
+// Poller thread function (in epoll mode, it is also the acceptor)
+void *poller_thread(void *arg) {
+  poller_t *p = (poller_t *)arg;
+  struct epoll_event events[64];
+
+  while (1) {
+    int n = epoll_wait(p->epoll_fd, events, 64, 1000);
+    assert(n >= 0 || errno == EINTR);
+    for (int i = 0; i < n; i++) {
+      conn_t *conn = events[i].data.ptr;
+      if (conn == NULL) {
+        poller_accept(p);
+        continue;
+      }
+
+      int rc = conn_fill(conn);
+      if (rc == 0) {
+        poller_arm(p, conn); // still waiting for the rest of the header
+        continue;
+      }
+      pthread_mutex_lock(&p->mutex);
+      poller_unlink(p, conn);
+      pthread_mutex_unlock(&p->mutex);
+      if (rc > 0)
+        dispatch(conn);
+      else
+        conn_close(conn);
+    }
+
+    // Close connections whose deadline has passed (idle keep-alive
+    // connections, and clients that never finish sending their header)
+    time_t now = time(NULL);
+    pthread_mutex_lock(&p->mutex);
+    conn_t *conn = p->idle_head;
+    while (conn) {
+      conn_t *next = conn->next;
+      if (now >= conn->deadline) {
+        poller_unlink(p, conn);
+        conn_close(conn); // also removes it from the epoll set
+      }
+      conn = next;
+    }
+    pthread_mutex_unlock(&p->mutex);
+  }
+  return NULL;
+}
+
+// Acceptor thread function (thread mode; 'arg' is the shard)
+// With several acceptors, connections are non-blocking like in epoll mode;
+// the io helpers wait out EAGAIN, so workers can still read and write them
+// as if they blocked
+void *acceptor_thread(void *arg) {
+  int shard = (int)(intptr_t)arg;
+  int flags = SOCK_CLOEXEC | (num_acceptors > 1 ? SOCK_NONBLOCK : 0);
+  while (1) {
+    int conn_fd = accept4(listen_fds[shard], NULL, NULL, flags);
+    if (conn_fd < 0) {
+      // out of descriptors: back off rather than spin
+      if (errno == EMFILE || errno == ENFILE)
+        poll(NULL, 0, 10);
+      continue; // EINTR, ECONNABORTED, ...: just try again
+    }
+    dispatch(conn_new(conn_fd, shard));
+  }
+  return NULL;
+}
+
+// Pin the calling thread to the n-th CPU it may run on (wrapping around)
+void pin_to_cpu(int n) {
+  cpu_set_t allowed, set;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return;
+  n %= CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      return;
+    }
+  }
+}
+
+// Worker thread function ('arg' is the worker's index)
 void *worker_thread(void *arg) {
+  int id = (int)(intptr_t)arg;
+  if (pin_cpus)
+    pin_to_cpu(id);
+  stats_t *stats = stats_thread();
+  stats->worker = id;
+
+  request_queue_t *queue = queues[id % num_acceptors];
+
   while (1) {
-    request_t req = queue_remove(queue);
-    if (req.fd == -1 && queue->shutdown) {
+    request_t req = pool ? pool_remove(pool, id) : queue_remove(queue);
+    if (req.conn == NULL && (pool ? pool->shutdown : queue->shutdown)) {
       break;
     }
-    if (req.fd != -1) {
-      if (req.has_first_line) {
-        request_handle_with_first_line(req.fd, req.first_line);
-      } else {
-        request_handle(req.fd);
-      }
-      close_or_die(req.fd);
+    if (req.conn != NULL) {
+      conn_t *conn = req.conn;
+      int keep_alive;
+      stats->dequeued++;
+      long long picked_up = stats_lap(STAGE_QUEUE, req.queued_us);
+      long long start = req.queued_us;
+      // Serve pipelined requests back-to-back while they are already buffered
+      do {
+        conn->num_requests++;
+        keep_alive = request_handle(&conn->rio, keepalive_timeout > 0 &&
+                                                    conn->num_requests <
+                                                        max_requests);
+        start = stats_lap(STAGE_TOTAL, start);
+      } while (keep_alive && rio_has_header(&conn->rio));
+      stats->busy_us += start - picked_up;
+
+      if (keep_alive)
+        poller_add(pollers[conn->shard], conn, keepalive_timeout);
+      else
+        conn_close(conn);
     }
   }
   return NULL;
@@ -202,14 +674,15 @@ void *worker_thread(void *arg) {
 
 //
 // ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s
-// <schedalg>]
+// <schedalg>] [-k <keepalive_secs>] [-r <max_requests>] [-m <mode>]
+// [-c <cache_mb>] [-w] [-P] [-a <acceptors>] [-L <none|sync|async>]
 //
 int main(int argc, char *argv[]) {
   int c;
   char *root_dir = default_root;
   int port = 10000;
 
-  while ((c = getopt(argc, argv, "d:p:t:b:s:")) != -1)
+  while ((c = getopt(argc, argv, "d:p:t:b:s:k:r:m:c:wPa:L:g:")) != -1)
     switch (c) {
     case 'd':
       root_dir = optarg;
@@ -233,70 +706,173 @@ int main(int argc, char *argv[]) {
       break;
     case 's':
       schedalg = optarg;
-      if (strcmp(schedalg, "FIFO") != 0 && strcmp(schedalg, "SFF") != 0) {
-        fprintf(stderr, "schedalg must be FIFO or SFF\n");
+      if (strcmp(schedalg, "FIFO") != 0 && strcmp(schedalg, "SFF") != 0 &&
+          strcmp(schedalg, "SFF-AGE") != 0) {
+        fprintf(stderr, "schedalg must be FIFO, SFF or SFF-AGE\n");
+        exit(1);
+      }
+      break;
+    case 'k':
+      keepalive_timeout = atoi(optarg);
+      if (keepalive_timeout < 0) {
+        fprintf(stderr, "keepalive timeout must not be negative\n");
+        exit(1);
+      }
+      break;
+    case 'r':
+      max_requests = atoi(optarg);
+      if (max_requests <= 0) {
+        fprintf(stderr, "max requests must be positive\n");
+        exit(1);
+      }
+      break;
+    case 'm':
+      mode = optarg;
+      if (strcmp(mode, "thread") != 0 && strcmp(mode, "epoll") != 0) {
+        fprintf(stderr, "mode must be thread or epoll\n");
+        exit(1);
+      }
+      break;
+    case 'c':
+      cache_mb = atoi(optarg);
+      if (cache_mb < 0) {
+        fprintf(stderr, "cache size must not be negative\n");
+        exit(1);
+      }
+      break;
+    case 'w':
+      work_stealing = 1;
+      break;
+    case 'P':
+      pin_cpus = 1;
+      break;
+    case 'a':
+      num_acceptors = atoi(optarg);
+      if (num_acceptors <= 0) {
+        fprintf(stderr, "acceptors must be positive\n");
+        exit(1);
+      }
+      break;
+    case 'g':
+      sff_age_max_delay = atoi(optarg);
+      if (sff_age_max_delay < 0) {
+        fprintf(stderr, "SFF-AGE delay must not be negative\n");
+        exit(1);
+      }
+      break;
+    case 'L':
+      if (strcmp(optarg, "none") == 0)
+        log_mode = LOG_NONE;
+      else if (strcmp(optarg, "sync") == 0)
+        log_mode = LOG_SYNC;
+      else if (strcmp(optarg, "async") == 0)
+        log_mode = LOG_ASYNC;
+      else {
+        fprintf(stderr, "log mode must be none, sync or async\n");
         exit(1);
       }
       break;
     default:
       fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b "
-                      "buffers] [-s schedalg]\n");
+                      "buffers] [-s schedalg] [-k keepalive_secs] [-r "
+                      "max_requests] [-m thread|epoll] [-c cache_mb] [-w] "
+                      "[-P] [-a acceptors] [-L none|sync|async] "
+                      "[-g max_age_delay_secs]\n");
       exit(1);
     }
 
+  if (work_stealing && strcmp(schedalg, "FIFO") != 0) {
+    fprintf(stderr, "work stealing (-w) requires FIFO scheduling\n");
+    exit(1);
+  }
+
+  if (!work_stealing && num_threads < num_acceptors) {
+    fprintf(stderr, "need at least one worker thread per acceptor\n");
+    exit(1);
+  }
+
+  if (!work_stealing && buffer_size < num_acceptors) {
+    fprintf(stderr, "need at least one buffer per acceptor\n");
+    exit(1);
+  }
+
   // run out of this directory
   chdir_or_die(root_dir);
 
-  // Initialize request queue
-  queue = queue_init(buffer_size);
+  // a client hanging up mid-response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // GET /__stats reports on everything from here on
+  stats_init();
+  access_log_init(log_mode);
+
+  // Initialize request queues (-b is split between the shards, the first
+  // ones taking the remainder)
+  queues = malloc(sizeof(request_queue_t *) * num_acceptors);
+  for (int i = 0; i < num_acceptors; i++)
+    queues[i] = queue_init(buffer_size / num_acceptors +
+                               (i < buffer_size % num_acceptors),
+                           strcmp(schedalg, "FIFO") != 0);
+  // or per-worker rings
+  if (work_stealing)
+    pool = pool_init(num_threads, buffer_size);
+
+  // Open descriptors for hot static files are kept across requests
+  fd_cache_init(FD_CACHE_SIZE);
+  // and, optionally, complete responses for small ones
+  if (cache_mb > 0)
+    resp_cache_init((size_t)cache_mb * 1024 * 1024);
 
   // Create worker threads
   pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
   for (int i = 0; i < num_threads; i++) {
-    pthread_create(&threads[i], NULL, worker_thread, NULL);
+    pthread_create(&threads[i], NULL, worker_thread, (void *)(intptr_t)i);
   }
 
-  // now, get to work
-  int listen_fd = open_listen_fd_or_die(port);
-  while (1) {
-    struct sockaddr_in client_addr;
-    int client_len = sizeof(client_addr);
-    int conn_fd = accept_or_die(listen_fd, (sockaddr_t *)&client_addr,
-                                (socklen_t *)&client_len);
-
-    request_t req;
-    req.fd = conn_fd;
-    req.has_first_line = 0;
-
-    if (strcmp(schedalg, "SFF") == 0) {
-      // For SFF, need to get file size first
-      // This reads the first line and stores it
-      req.file_size = get_file_size(conn_fd, req.first_line);
-      if (req.file_size < 0) {
-        // If we can't read the request line, treat as error
-        request_error(conn_fd, "", "400", "Bad Request",
-                      "Could not read request");
-        close_or_die(conn_fd);
-        continue;
-      }
-      req.has_first_line = 1;
-      queue_insert_sff(queue, req);
+  // now, get to work: one listening socket per acceptor (the kernel spreads
+  // connections over them), each with its own poller and acceptor thread.
+  // A single acceptor keeps the plain socket options.
+  int listen_flags = 0;
+  if (num_acceptors > 1)
+    listen_flags = LISTEN_REUSEPORT | LISTEN_NODELAY | LISTEN_DEFER_ACCEPT;
+  listen_fds = malloc(sizeof(int) * num_acceptors);
+  pollers = malloc(sizeof(poller_t *) * num_acceptors);
+  pthread_t *acceptors = malloc(sizeof(pthread_t) * num_acceptors);
+  for (int i = 0; i < num_acceptors; i++) {
+    listen_fds[i] = open_listen_fd_opts_or_die(port, listen_flags);
+    if (strcmp(mode, "epoll") == 0) {
+      // Event-driven front end: the poller accepts connections and buffers
+      // their request headers; workers only see complete requests
+      pollers[i] = poller_init(listen_fds[i], i);
+      pthread_create(&acceptors[i], NULL, poller_thread, pollers[i]);
     } else {
-      // FIFO scheduling
-      req.file_size = 0; // Not used for FIFO
-      req.has_first_line = 0;
-      queue_insert_fifo(queue, req);
+      // Blocking acceptor, plus a poller for idle keep-alive connections
+      pollers[i] = poller_init(-1, i);
+      pthread_t poller_tid;
+      pthread_create(&poller_tid, NULL, poller_thread, pollers[i]);
+      pthread_create(&acceptors[i], NULL, acceptor_thread, (void *)(intptr_t)i);
     }
   }
+  for (int i = 0; i < num_acceptors; i++) {
+    pthread_join(acceptors[i], NULL);
+  }
 
   // Cleanup (this code won't normally be reached)
-  queue->shutdown = 1;
-  pthread_cond_broadcast(&queue->not_empty);
+  for (int i = 0; i < num_acceptors; i++) {
+    queues[i]->shutdown = 1;
+    pthread_cond_broadcast(&queues[i]->not_empty);
+  }
+  if (pool) {
+    pool->shutdown = 1;
+    for (int i = 0; i < num_threads; i++)
+      sem_post(&pool->items);
+  }
   for (int i = 0; i < num_threads; i++) {
     pthread_join(threads[i], NULL);
   }
   free(threads);
-  queue_destroy(queue);
+  for (int i = 0; i < num_acceptors; i++)
+    queue_destroy(queues[i]);
 
   return 0;
 }
@@ -0,0 +1,220 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ufs.h"
+#include "bcache.h"
+#include "balloc.h"
+
+typedef struct {
+    unsigned int *bits;     // pinned in bcache, bitmap_len blocks long
+    int addr;               // first bitmap block, to mark blocks dirty
+    int count;              // entries (bits past it are never handed out)
+    int free;               // free entries
+    int hint;               // no entry below it is free
+} bitmap_t;
+
+static bitmap_t inodes, blocks;
+static int data_addr;
+
+#define WORD_BITS (8 * sizeof(unsigned int))
+#define ENTS_PER_BITMAP_BLOCK (8 * UFS_BLOCK_SIZE)
+
+static int get_bit(bitmap_t *b, int n) {
+    return (b->bits[n / WORD_BITS] >> (WORD_BITS - 1 - n % WORD_BITS)) & 1;
+}
+
+static void set_bit(bitmap_t *b, int n, int value) {
+    unsigned int mask = 1U << (WORD_BITS - 1 - n % WORD_BITS);
+    if (value)
+	b->bits[n / WORD_BITS] |= mask;
+    else
+	b->bits[n / WORD_BITS] &= ~mask;
+    bcache_dirty(b->addr + n / ENTS_PER_BITMAP_BLOCK);
+}
+
+// Entries [n, n + 64) as one value, entry n in the top bit. Entries past
+// the end of the bitmap read as allocated.
+static uint64_t get_word64(bitmap_t *b, int n) {
+    uint64_t v = ((uint64_t) b->bits[n / WORD_BITS] << 32) |
+	b->bits[n / WORD_BITS + 1];
+    if (b->count - n < 64)
+	v |= ~(uint64_t) 0 >> (b->count - n);
+    return v;
+}
+
+// First free entry at or after 'from' (64-aligned), or -1
+static int scan(bitmap_t *b, int from) {
+    int n;
+    for (n = from; n < b->count; n += 64) {
+	uint64_t v = get_word64(b, n);
+	if (v != ~(uint64_t) 0)
+	    return n + __builtin_clzll(~v);
+    }
+    return -1;
+}
+
+// First entirely free 64-entry group at or after 'from' (64-aligned), or -1
+static int scan_empty(bitmap_t *b, int from) {
+    int n;
+    for (n = from; n < b->count; n += 64)
+	if (get_word64(b, n) == 0)
+	    return n;
+    return -1;
+}
+
+static void init_bitmap(bitmap_t *b, int addr, int count) {
+    b->bits = bcache_get(addr);
+    b->addr = addr;
+    b->count = count;
+    b->free = 0;
+    b->hint = -1;
+    int n;
+    for (n = 0; n < count; n += 64) {
+	uint64_t v = get_word64(b, n);
+	b->free += __builtin_popcountll(~v);
+	if (b->hint == -1 && v != ~(uint64_t) 0)
+	    b->hint = n + __builtin_clzll(~v);
+    }
+    if (b->hint == -1)
+	b->hint = count;
+}
+
+int balloc_init() {
+    super_t *s = bcache_super();
+    // bitmap blocks are whole, so the 64-bit reads never run past them
+    assert(ENTS_PER_BITMAP_BLOCK % 64 == 0);
+    if (s->num_inodes > s->inode_bitmap_len * ENTS_PER_BITMAP_BLOCK ||
+	s->num_data > s->data_bitmap_len * ENTS_PER_BITMAP_BLOCK) {
+	fprintf(stderr, "balloc: bitmaps too short for the image\n");
+	return -1;
+    }
+    init_bitmap(&inodes, s->inode_bitmap_addr, s->num_inodes);
+    init_bitmap(&blocks, s->data_bitmap_addr, s->num_data);
+    data_addr = s->data_region_addr;
+    return 0;
+}
+
+static int alloc(bitmap_t *b, int goal) {
+    if (b->free == 0)
+	return -1;
+    int n = -1;
+    if (goal >= 0 && goal < b->count) {
+	if (!get_bit(b, goal))
+	    n = goal;
+	else if ((n = scan_empty(b, (goal + 63) & ~63)) == -1) {
+	    // someone else is writing right after us: rather than alternate
+	    // blocks with them, move to an empty group if there is one, and
+	    // otherwise take the next free entry after the goal
+	    int base = goal & ~63;
+	    uint64_t v = get_word64(b, base) | ~(~(uint64_t) 0 >> (goal - base));
+	    if (v != ~(uint64_t) 0)
+		n = base + __builtin_clzll(~v);
+	    else
+		n = scan(b, base + 64);
+	}
+    }
+    if (n == -1)
+	n = scan(b, b->hint & ~63);
+    assert(n >= 0);
+    set_bit(b, n, 1);
+    b->free--;
+    if (n == b->hint) {
+	int next = b->free ? scan(b, n & ~63) : -1;
+	b->hint = next == -1 ? b->count : next;
+    }
+    return n;
+}
+
+static void release(bitmap_t *b, int n) {
+    if (n < 0 || n >= b->count || !get_bit(b, n))
+	return;
+    set_bit(b, n, 0);
+    b->free++;
+    if (n < b->hint)
+	b->hint = n;
+}
+
+int balloc_inode() {
+    return alloc(&inodes, -1);
+}
+
+void bfree_inode(int inum) {
+    release(&inodes, inum);
+}
+
+int balloc_block(int goal) {
+    int n = alloc(&blocks, goal == -1 ? -1 : goal - data_addr);
+    return n == -1 ? -1 : data_addr + n;
+}
+
+void bfree_block(int block) {
+    release(&blocks, block - data_addr);
+}
+
+int balloc_file_block(int inum, int index) {
+    inode_t *ip = bcache_inode(inum);
+    if (ip == NULL || index < 0 || index >= DIRECT_PTRS)
+	return -1;
+    int goal = -1;
+    if (index > 0 && ip->direct[index - 1] != -1)
+	goal = ip->direct[index - 1] + 1;
+    int block = balloc_block(goal);
+    if (block == -1)
+	return -1;
+    ip->direct[index] = block;
+    bcache_dirty(bcache_inode_block(inum));
+    return block;
+}
+
+int balloc_free_inodes() {
+    return inodes.free;
+}
+
+int balloc_free_blocks() {
+    return blocks.free;
+}
+
+void balloc_report(FILE *out) {
+    // free extents in the data region
+    int extents = 0, largest = 0, run = 0, n;
+    for (n = 0; n <= blocks.count; n++) {
+	if (n < blocks.count && !get_bit(&blocks, n)) {
+	    run++;
+	    continue;
+	}
+	if (run > 0) {
+	    extents++;
+	    if (run > largest)
+		largest = run;
+	}
+	run = 0;
+    }
+
+    // files whose direct[] blocks are not one contiguous run
+    int files = 0, fragmented = 0, pieces = 0, i;
+    for (n = 0; n < inodes.count; n++) {
+	if (!get_bit(&inodes, n))
+	    continue;
+	inode_t *ip = bcache_inode(n);
+	int used = (ip->size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+	int prev = -1, file_pieces = 0;
+	for (i = 0; i < used && i < DIRECT_PTRS; i++) {
+	    if (prev == -1 || ip->direct[i] != prev + 1)
+		file_pieces++;
+	    prev = ip->direct[i];
+	}
+	files++;
+	pieces += file_pieces;
+	if (file_pieces > 1)
+	    fragmented++;
+    }
+
+    fprintf(out, "free inodes         %d of %d\n", inodes.free, inodes.count);
+    fprintf(out, "free data blocks    %d of %d\n", blocks.free, blocks.count);
+    fprintf(out, "fragmentation\n");
+    fprintf(out, "  free extents      %d [largest: %d blocks]\n", extents, largest);
+    fprintf(out, "  files             %d [fragmented: %d, extents: %d]\n",
+	    files, fragmented, pieces);
+}
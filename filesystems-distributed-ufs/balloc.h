@@ -0,0 +1,46 @@
+#ifndef __balloc_h__
+#define __balloc_h__
+
+#include <stdio.h>
+
+#include "ufs.h"
+
+//
+// Inode and data block allocator for the server, over the bitmaps that
+// bcache keeps pinned.
+//
+// Bitmaps are arrays of 32-bit words, MSB first (entry 0 is the top bit
+// of word 0, as mkfs writes it), so two words read as one 64-bit value
+// keep entry order, and __builtin_clzll() of its complement finds the
+// first free entry among 64. Each bitmap keeps a count of free entries
+// and a hint below which nothing is free, so a full bitmap fails at once
+// and a search never rescans the allocated prefix.
+//
+
+int balloc_init();
+
+// Allocate an inode; returns its number, or -1 if there are none left
+int balloc_inode();
+void bfree_inode(int inum);
+
+// Allocate a data block (a block address, not a bitmap index), preferring
+// 'goal', then an empty 64-block group after it, then the first free
+// block after it (pass -1 for plain first fit). Returns -1 if the data
+// region is full.
+int balloc_block(int goal);
+void bfree_block(int block);
+
+// Allocate block 'index' of a file, right after its block 'index - 1'
+// when possible, so sequential reads see adjacent blocks. If that block
+// is taken, a 64-block group that is still empty is preferred, so two
+// files growing at once do not interleave. Sets direct[index] and marks
+// the inode dirty; returns the block or -1.
+int balloc_file_block(int inum, int index);
+
+int balloc_free_inodes();
+int balloc_free_blocks();
+
+// mkfs -v style summary of free space and file fragmentation
+void balloc_report(FILE *out);
+
+#endif // __balloc_h__
@@ -0,0 +1,348 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+typedef struct slot {
+    int block;              // -1 if the slot is free
+    int dirty;
+    int referenced;         // CLOCK bit: used since the hand last passed
+    int loading;            // being filled by readahead, not evictable
+    struct slot *hash_next;
+    char *data;
+} slot_t;
+
+static int image_fd = -1;
+static super_t *super;      // points into block 0 of meta
+
+// super block, bitmaps and inode region: blocks [0, meta_blocks), pinned
+static char *meta;
+static int meta_blocks;
+static char *meta_dirty;
+
+// data region: a hash of block number to slot, and a CLOCK hand
+static slot_t *slots;
+static int num_slots;
+static int hand;
+static slot_t **buckets;
+static int num_buckets;
+
+// the last file block read, to spot sequential patterns
+static int last_inum = -1;
+static int last_index = -1;
+
+static bcache_stats_t stats;
+
+static char *meta_block(int block) {
+    return meta + (size_t) block * UFS_BLOCK_SIZE;
+}
+
+static int is_data_block(int block) {
+    return block >= super->data_region_addr &&
+	block < super->data_region_addr + super->data_region_len;
+}
+
+static slot_t *lookup(int block) {
+    slot_t *s = buckets[block % num_buckets];
+    while (s && s->block != block)
+	s = s->hash_next;
+    return s;
+}
+
+static void hash_remove(slot_t *s) {
+    slot_t **pp = &buckets[s->block % num_buckets];
+    while (*pp != s)
+	pp = &(*pp)->hash_next;
+    *pp = s->hash_next;
+}
+
+static int write_block(int block, char *data) {
+    stats.writebacks++;
+    if (pwrite(image_fd, data, UFS_BLOCK_SIZE, (off_t) block * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+	perror("pwrite");
+	return -1;
+    }
+    return 0;
+}
+
+// Take a slot for 'block' (not yet read), evicting with CLOCK. A dirty
+// victim is written back first; it is fsync()ed by the next commit.
+// Returns NULL if two full turns of the hand free nothing (every slot is
+// loading, or dirty and failing to write back).
+static slot_t *claim(int block) {
+    slot_t *s;
+    int steps;
+    for (steps = 0;; steps++) {
+	if (steps == 2 * num_slots)
+	    return NULL;
+	s = &slots[hand];
+	hand = (hand + 1) % num_slots;
+	if (s->block == -1)
+	    break;
+	if (s->loading)
+	    continue;
+	if (s->referenced) {
+	    s->referenced = 0;
+	    continue;
+	}
+	if (s->dirty && write_block(s->block, s->data) < 0)
+	    continue; // keep it, and its data, for the next commit to retry
+	hash_remove(s);
+	break;
+    }
+    s->block = block;
+    s->dirty = 0;
+    s->referenced = 1;
+    s->hash_next = buckets[block % num_buckets];
+    buckets[block % num_buckets] = s;
+    return s;
+}
+
+static void release(slot_t *s) {
+    hash_remove(s);
+    s->block = -1;
+    s->dirty = 0;
+    s->loading = 0;
+}
+
+int bcache_init(int fd, int capacity) {
+    image_fd = fd;
+    assert(capacity > BCACHE_READAHEAD);
+
+    super_t s;
+    if (pread(fd, &s, sizeof(super_t), 0) != sizeof(super_t)) {
+	perror("pread");
+	return -1;
+    }
+    meta_blocks = s.data_region_addr;
+    meta = malloc((size_t) meta_blocks * UFS_BLOCK_SIZE);
+    meta_dirty = calloc(meta_blocks, 1);
+    if (meta == NULL || meta_dirty == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    ssize_t bytes = (ssize_t) meta_blocks * UFS_BLOCK_SIZE;
+    if (pread(fd, meta, bytes, 0) != bytes) {
+	perror("pread");
+	return -1;
+    }
+    super = (super_t *) meta;
+
+    num_slots = capacity;
+    num_buckets = 2 * capacity;
+    slots = calloc(num_slots, sizeof(slot_t));
+    buckets = calloc(num_buckets, sizeof(slot_t *));
+    char *data = malloc((size_t) num_slots * UFS_BLOCK_SIZE);
+    if (slots == NULL || buckets == NULL || data == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    int i;
+    for (i = 0; i < num_slots; i++) {
+	slots[i].block = -1;
+	slots[i].data = data + (size_t) i * UFS_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+super_t *bcache_super() {
+    return super;
+}
+
+void *bcache_get(int block) {
+    if (block >= 0 && block < meta_blocks)
+	return meta_block(block);
+    if (!is_data_block(block))
+	return NULL;
+
+    slot_t *s = lookup(block);
+    if (s) {
+	stats.hits++;
+	s->referenced = 1;
+	return s->data;
+    }
+    stats.misses++;
+    s = claim(block);
+    if (s == NULL)
+	return NULL;
+    if (pread(image_fd, s->data, UFS_BLOCK_SIZE, (off_t) block * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE) {
+	perror("pread");
+	release(s);
+	return NULL;
+    }
+    return s->data;
+}
+
+void *bcache_get_new(int block) {
+    char *data;
+    if (block >= 0 && block < meta_blocks) {
+	data = meta_block(block);
+    } else if (is_data_block(block)) {
+	slot_t *s = lookup(block);
+	if (s == NULL && (s = claim(block)) == NULL)
+	    return NULL;
+	s->referenced = 1;
+	data = s->data;
+    } else {
+	return NULL;
+    }
+    memset(data, 0, UFS_BLOCK_SIZE);
+    bcache_dirty(block);
+    return data;
+}
+
+void bcache_dirty(int block) {
+    if (block >= 0 && block < meta_blocks) {
+	meta_dirty[block] = 1;
+	return;
+    }
+    slot_t *s = is_data_block(block) ? lookup(block) : NULL;
+    assert(s != NULL); // dirtied blocks must have been gotten first
+    s->dirty = 1;
+}
+
+inode_t *bcache_inode(int inum) {
+    if (inum < 0 || inum >= super->num_inodes)
+	return NULL;
+    return (inode_t *) meta_block(super->inode_region_addr) + inum;
+}
+
+int bcache_inode_block(int inum) {
+    return super->inode_region_addr + inum * sizeof(inode_t) / UFS_BLOCK_SIZE;
+}
+
+// Read a run of n claimed slots for adjacent blocks with one preadv()
+static void read_run(slot_t **run, struct iovec *iov, int n) {
+    off_t offset = (off_t) run[0]->block * UFS_BLOCK_SIZE;
+    ssize_t rc = preadv(image_fd, iov, n, offset);
+    int j;
+    for (j = 0; j < n; j++) {
+	run[j]->loading = 0;
+	if (rc != (ssize_t) n * UFS_BLOCK_SIZE)
+	    release(run[j]);
+	else
+	    stats.readahead++;
+    }
+}
+
+// Load the uncached ones among direct[first .. first + count), reading
+// each run of adjacent block numbers with a single preadv()
+static void readahead(inode_t *inode, int first, int count) {
+    struct iovec iov[BCACHE_READAHEAD];
+    slot_t *run[BCACHE_READAHEAD];
+    int n = 0;
+    int i;
+    for (i = first; i <= first + count; i++) {
+	int block = -1;
+	if (i < first + count && i < DIRECT_PTRS) {
+	    block = inode->direct[i];
+	    if (!is_data_block(block) || lookup(block) != NULL)
+		block = -1;
+	}
+	// the run ends here: read it
+	if (n > 0 && block != run[n - 1]->block + 1) {
+	    read_run(run, iov, n);
+	    n = 0;
+	}
+	if (block == -1) {
+	    if (i >= DIRECT_PTRS)
+		break;
+	    continue;
+	}
+	slot_t *s = claim(block);
+	if (s == NULL) {
+	    // no slot to spare: just read what we have
+	    if (n > 0)
+		read_run(run, iov, n);
+	    return;
+	}
+	s->loading = 1;
+	s->referenced = 0; // not used yet: first to go if it never is
+	iov[n].iov_base = s->data;
+	iov[n].iov_len = UFS_BLOCK_SIZE;
+	run[n++] = s;
+    }
+}
+
+void *bcache_get_file_block(int inum, int index) {
+    inode_t *inode = bcache_inode(inum);
+    if (inode == NULL || index < 0 || index >= DIRECT_PTRS)
+	return NULL;
+    int sequential = inum == last_inum && index == last_index + 1;
+    last_inum = inum;
+    last_index = index;
+    if (sequential)
+	readahead(inode, index + 1, BCACHE_READAHEAD);
+    return bcache_get(inode->direct[index]);
+}
+
+typedef struct {
+    int block;
+    char *data;
+    slot_t *slot; // NULL for metadata
+} dirty_t;
+
+static int compare_dirty(const void *a, const void *b) {
+    return ((dirty_t *) a)->block - ((dirty_t *) b)->block;
+}
+
+int bcache_commit() {
+    dirty_t *list = malloc((meta_blocks + num_slots) * sizeof(dirty_t));
+    if (list == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    int n = 0;
+    int i;
+    for (i = 0; i < meta_blocks; i++)
+	if (meta_dirty[i])
+	    list[n++] = (dirty_t) { i, meta_block(i), NULL };
+    for (i = 0; i < num_slots; i++)
+	if (slots[i].block != -1 && slots[i].dirty)
+	    list[n++] = (dirty_t) { slots[i].block, slots[i].data, &slots[i] };
+    qsort(list, n, sizeof(dirty_t), compare_dirty);
+
+    // one pwritev() per run of adjacent blocks
+    int rc = 0;
+    struct iovec iov[64];
+    for (i = 0; i < n;) {
+	int j = i;
+	while (j < n && j - i < 64 && list[j].block == list[i].block + (j - i)) {
+	    iov[j - i].iov_base = list[j].data;
+	    iov[j - i].iov_len = UFS_BLOCK_SIZE;
+	    j++;
+	}
+	ssize_t bytes = (ssize_t) (j - i) * UFS_BLOCK_SIZE;
+	if (pwritev(image_fd, iov, j - i, (off_t) list[i].block * UFS_BLOCK_SIZE) != bytes) {
+	    perror("pwritev");
+	    rc = -1; // leave these dirty, so the next commit retries them
+	} else {
+	    int k;
+	    for (k = i; k < j; k++) {
+		if (list[k].slot)
+		    list[k].slot->dirty = 0;
+		else
+		    meta_dirty[list[k].block] = 0;
+	    }
+	}
+	stats.writebacks += j - i;
+	i = j;
+    }
+    free(list);
+
+    stats.commits++;
+    if (fsync(image_fd) < 0) {
+	perror("fsync");
+	rc = -1;
+    }
+    return rc;
+}
+
+void bcache_stats(bcache_stats_t *s) {
+    *s = stats;
+}
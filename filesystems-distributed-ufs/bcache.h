@@ -0,0 +1,70 @@
+#ifndef __bcache_h__
+#define __bcache_h__
+
+#include "ufs.h"
+
+//
+// Block cache for the server's file system image.
+//
+// Every access to the image goes through here, at UFS_BLOCK_SIZE
+// granularity. The super block, both bitmaps and the inode region are
+// loaded once by bcache_init() and stay pinned, so lookups, stats and
+// allocations never touch the disk. Data blocks are cached in a fixed
+// number of slots recycled with CLOCK.
+//
+// Writes only mark blocks dirty. bcache_commit() writes all of them back
+// in block order, coalescing neighbours into one pwritev(), and then
+// issues a single fsync(). The server calls it once per request group,
+// before replying.
+//
+// The server is single-threaded, so there is no locking.
+//
+
+#define BCACHE_SLOTS     (1024) // default number of cached data blocks
+#define BCACHE_READAHEAD (8)    // blocks to prefetch on a sequential read
+
+// Open the cache over the image 'fd' with room for 'slots' data blocks.
+// Returns 0, or -1 if the image cannot be read.
+int bcache_init(int fd, int slots);
+
+// The pinned in-memory super block.
+super_t *bcache_super();
+
+// Pointer to the cached contents of 'block', valid until the next
+// bcache call that may load a block (pinned metadata stays valid for
+// good). Returns NULL if the block is out of range or cannot be read,
+// or if no cache slot can be freed (dirty blocks failing to write back).
+void *bcache_get(int block);
+
+// Like bcache_get(), but the whole block is about to be written, so it
+// is not read from disk first. The block is marked dirty.
+void *bcache_get_new(int block);
+
+// Record that the caller changed the contents of 'block'.
+void bcache_dirty(int block);
+
+// Pointer to inode 'inum' inside the pinned inode region
+// (call bcache_dirty(bcache_inode_block(inum)) after changing it).
+inode_t *bcache_inode(int inum);
+int bcache_inode_block(int inum);
+
+// Read block 'index' of a file through its direct[] pointers. When the
+// same inode is read at consecutive indexes, the next BCACHE_READAHEAD
+// blocks are loaded too, with one preadv() per run of adjacent blocks.
+void *bcache_get_file_block(int inum, int index);
+
+// Write back every dirty block and fsync() the image once.
+// Returns 0, or -1 if a write or the fsync failed.
+int bcache_commit();
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long readahead;   // blocks loaded ahead of being asked for
+    unsigned long writebacks;  // blocks written
+    unsigned long commits;     // fsync()s
+} bcache_stats_t;
+
+void bcache_stats(bcache_stats_t *stats);
+
+#endif // __bcache_h__
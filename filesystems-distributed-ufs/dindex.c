@@ -0,0 +1,265 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ufs.h"
+#include "bcache.h"
+#include "dindex.h"
+
+typedef struct {
+    int pos;                // index * DIR_ENTS_PER_BLOCK + slot; -1 if empty
+    unsigned long hash;
+} bucket_t;
+
+typedef struct {
+    bucket_t *buckets;      // open addressing, linear probing
+    int capacity;           // power of 2
+    int count;              // entries, including "." and ".."
+    int *free;              // stack of free slots
+    int num_free;
+    int last;               // highest used slot, gives the directory size
+    char *used;             // one flag per slot, to find the new 'last'
+} dir_index_t;
+
+static dir_index_t **indexes; // by inode number, built on first use
+static int num_inodes;
+
+static unsigned long hash(char *name) {
+    unsigned long h = 5381;
+    int i;
+    for (i = 0; i < 28 && name[i] != '\0'; i++)
+	h = h * 33 + (unsigned char) name[i];
+    return h;
+}
+
+// The on-disk entry at a slot (its block is cached by bcache)
+static dir_ent_t *entry(inode_t *dir, int pos) {
+    dir_ent_t *block = bcache_get(dir->direct[pos / DIR_ENTS_PER_BLOCK]);
+    return block ? &block[pos % DIR_ENTS_PER_BLOCK] : NULL;
+}
+
+static void dirty_entry(inode_t *dir, int pos) {
+    bcache_dirty(dir->direct[pos / DIR_ENTS_PER_BLOCK]);
+}
+
+int dindex_init() {
+    num_inodes = bcache_super()->num_inodes;
+    indexes = calloc(num_inodes, sizeof(dir_index_t *));
+    if (indexes == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    return 0;
+}
+
+static void table_insert(dir_index_t *d, unsigned long h, int pos) {
+    int i = h & (d->capacity - 1);
+    while (d->buckets[i].pos != -1)
+	i = (i + 1) & (d->capacity - 1);
+    d->buckets[i].pos = pos;
+    d->buckets[i].hash = h;
+}
+
+static void table_grow(dir_index_t *d) {
+    bucket_t *old = d->buckets;
+    int old_capacity = d->capacity;
+    d->capacity = old_capacity ? 2 * old_capacity : 64;
+    d->buckets = malloc(d->capacity * sizeof(bucket_t));
+    if (d->buckets == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    int i;
+    for (i = 0; i < d->capacity; i++)
+	d->buckets[i].pos = -1;
+    for (i = 0; i < old_capacity; i++)
+	if (old[i].pos != -1)
+	    table_insert(d, old[i].hash, old[i].pos);
+    free(old);
+}
+
+static void push_free(dir_index_t *d, int pos) {
+    d->free[d->num_free++] = pos;
+}
+
+// Scan the directory's blocks once
+static dir_index_t *build(int inum) {
+    inode_t *dir = bcache_inode(inum);
+    if (dir == NULL || dir->type != UFS_DIRECTORY)
+	return NULL;
+
+    int slots = DIRECT_PTRS * DIR_ENTS_PER_BLOCK;
+    dir_index_t *d = calloc(1, sizeof(dir_index_t));
+    if (d == NULL || (d->free = malloc(slots * sizeof(int))) == NULL ||
+	(d->used = calloc(slots, 1)) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    d->last = -1;
+    table_grow(d);
+
+    int index, slot;
+    // backwards, so the free stack hands out the lowest slots first
+    for (index = DIRECT_PTRS - 1; index >= 0; index--) {
+	if (dir->direct[index] == -1)
+	    continue;
+	dir_ent_t *block = bcache_get(dir->direct[index]);
+	if (block == NULL)
+	    continue;
+	for (slot = DIR_ENTS_PER_BLOCK - 1; slot >= 0; slot--) {
+	    int pos = index * DIR_ENTS_PER_BLOCK + slot;
+	    if (block[slot].inum == -1) {
+		push_free(d, pos);
+		continue;
+	    }
+	    if (2 * (d->count + 1) > d->capacity)
+		table_grow(d);
+	    table_insert(d, hash(block[slot].name), pos);
+	    d->used[pos] = 1;
+	    d->count++;
+	    if (pos > d->last)
+		d->last = pos;
+	}
+    }
+    return d;
+}
+
+static dir_index_t *get_index(int inum) {
+    if (inum < 0 || inum >= num_inodes)
+	return NULL;
+    if (indexes[inum] == NULL)
+	indexes[inum] = build(inum);
+    return indexes[inum];
+}
+
+// Bucket holding 'name', or -1
+static int find(dir_index_t *d, inode_t *dir, char *name, unsigned long h) {
+    int i = h & (d->capacity - 1);
+    while (d->buckets[i].pos != -1) {
+	if (d->buckets[i].hash == h) {
+	    dir_ent_t *e = entry(dir, d->buckets[i].pos);
+	    if (e && strncmp(e->name, name, 28) == 0)
+		return i;
+	}
+	i = (i + 1) & (d->capacity - 1);
+    }
+    return -1;
+}
+
+int dindex_lookup(int pinum, char *name) {
+    dir_index_t *d = get_index(pinum);
+    if (d == NULL)
+	return -1;
+    inode_t *dir = bcache_inode(pinum);
+    int b = find(d, dir, name, hash(name));
+    return b == -1 ? -1 : entry(dir, d->buckets[b].pos)->inum;
+}
+
+static void set_size(int pinum, dir_index_t *d) {
+    inode_t *dir = bcache_inode(pinum);
+    dir->size = (d->last + 1) * sizeof(dir_ent_t);
+    bcache_dirty(bcache_inode_block(pinum));
+}
+
+int dindex_add(int pinum, char *name, int inum) {
+    dir_index_t *d = get_index(pinum);
+    if (d == NULL || strlen(name) >= 28)
+	return -1;
+    inode_t *dir = bcache_inode(pinum);
+    unsigned long h = hash(name);
+    if (d->num_free == 0 || find(d, dir, name, h) != -1)
+	return -1;
+    int pos = d->free[--d->num_free];
+    dir_ent_t *e = entry(dir, pos);
+    if (e == NULL) {
+	push_free(d, pos);
+	return -1;
+    }
+    memcpy(e->name, name, strlen(name) + 1);
+    e->inum = inum;
+    dirty_entry(dir, pos);
+
+    if (2 * (d->count + 1) > d->capacity)
+	table_grow(d);
+    table_insert(d, h, pos);
+    d->used[pos] = 1;
+    d->count++;
+    if (pos > d->last) {
+	d->last = pos;
+	set_size(pinum, d);
+    }
+    return 0;
+}
+
+int dindex_add_block(int pinum, int index) {
+    dir_index_t *d = get_index(pinum);
+    inode_t *dir = bcache_inode(pinum);
+    if (d == NULL || index < 0 || index >= DIRECT_PTRS)
+	return -1;
+    dir_ent_t *block = bcache_get_new(dir->direct[index]);
+    if (block == NULL)
+	return -1;
+    int slot;
+    for (slot = DIR_ENTS_PER_BLOCK - 1; slot >= 0; slot--) {
+	block[slot].inum = -1;
+	push_free(d, index * DIR_ENTS_PER_BLOCK + slot);
+    }
+    return 0;
+}
+
+int dindex_remove(int pinum, char *name) {
+    dir_index_t *d = get_index(pinum);
+    if (d == NULL)
+	return -1;
+    inode_t *dir = bcache_inode(pinum);
+    int b = find(d, dir, name, hash(name));
+    if (b == -1)
+	return -1;
+    int pos = d->buckets[b].pos;
+    dir_ent_t *e = entry(dir, pos);
+    int inum = e->inum;
+    e->inum = -1;
+    dirty_entry(dir, pos);
+    d->used[pos] = 0;
+    d->count--;
+    push_free(d, pos);
+
+    // backward-shift deletion keeps every probe chain unbroken
+    int mask = d->capacity - 1;
+    int hole = b, i = (b + 1) & mask;
+    while (d->buckets[i].pos != -1) {
+	int home = d->buckets[i].hash & mask;
+	if (((i - home) & mask) >= ((i - hole) & mask)) {
+	    d->buckets[hole] = d->buckets[i];
+	    hole = i;
+	}
+	i = (i + 1) & mask;
+    }
+    d->buckets[hole].pos = -1;
+
+    if (pos == d->last) {
+	while (d->last >= 0 && !d->used[d->last])
+	    d->last--;
+	set_size(pinum, d);
+    }
+    return inum;
+}
+
+int dindex_count(int pinum) {
+    dir_index_t *d = get_index(pinum);
+    if (d == NULL)
+	return -1;
+    return d->count - 2;
+}
+
+void dindex_drop(int inum) {
+    if (inum < 0 || inum >= num_inodes || indexes[inum] == NULL)
+	return;
+    dir_index_t *d = indexes[inum];
+    free(d->buckets);
+    free(d->free);
+    free(d->used);
+    free(d);
+    indexes[inum] = NULL;
+}
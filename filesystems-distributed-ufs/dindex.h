@@ -0,0 +1,46 @@
+#ifndef __dindex_h__
+#define __dindex_h__
+
+//
+// In-memory directory index for the server, on top of bcache.
+//
+// On disk a directory is a flat array of dir_ent_t (128 per block,
+// inum == -1 for a free slot), so a lookup is a linear scan. The first
+// time a directory is used, its blocks are scanned once into a hash of
+// name -> slot, plus a stack of free slots. After that, lookup, insert
+// and remove are O(1) and touch only the block being changed.
+//
+// The index is only coherent if every change to a directory's entries
+// goes through dindex_add()/dindex_remove().
+//
+
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
+int dindex_init();
+
+// Inode number of 'name' in directory 'pinum', or -1
+int dindex_lookup(int pinum, char *name);
+
+// Add the entry (name, inum) to directory 'pinum', and grow the
+// directory's size to cover it. Returns 0, or -1 if 'name' is already
+// there or every slot in its blocks is taken; in the latter case the
+// caller allocates a block at direct[index], calls dindex_add_block()
+// and retries (so look the name up first to tell the two apart).
+int dindex_add(int pinum, char *name, int inum);
+
+// A fresh block for direct[index] of directory 'pinum': fills it with
+// free entries and makes them available to dindex_add().
+int dindex_add_block(int pinum, int index);
+
+// Remove 'name' from directory 'pinum' (shrinking the directory's size
+// if it was the last entry). Returns the inode it named, or -1.
+int dindex_remove(int pinum, char *name);
+
+// Number of entries in directory 'pinum' other than "." and ".."
+// (for the not-empty check on unlink), or -1 if it is not a directory
+int dindex_count(int pinum);
+
+// Forget the index of 'inum' (when a directory is deleted)
+void dindex_drop(int inum);
+
+#endif // __dindex_h__
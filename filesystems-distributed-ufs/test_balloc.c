@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ufs.h"
+#include "bcache.h"
+#include "balloc.h"
+
+// usage: test_balloc <image made by mkfs -d 299 -i 100>
+//
+// 299 data blocks leave a partial 64-bit word at the end of the data
+// bitmap, so the tail mask gets exercised too.
+
+#define NUM_INODES (100)
+#define NUM_DATA (299)
+#define FILE_BLOCKS (20)
+
+// what the server does with a fresh inode
+static void init_inode(int inum, int type) {
+    inode_t *ip = bcache_inode(inum);
+    int i;
+    ip->type = type;
+    ip->size = 0;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	ip->direct[i] = -1;
+    bcache_dirty(bcache_inode_block(inum));
+}
+
+int main(int argc, char *argv[]) {
+    assert(argc == 2);
+    int fd = open(argv[1], O_RDWR);
+    assert(fd >= 0);
+    assert(bcache_init(fd, 64) == 0);
+    assert(balloc_init() == 0);
+    int data = bcache_super()->data_region_addr;
+
+    // mkfs used inode 0 and data block 0 for the root directory
+    assert(balloc_free_inodes() == NUM_INODES - 1);
+    assert(balloc_free_blocks() == NUM_DATA - 1);
+
+    // inodes come out lowest first, and the lowest freed one is reused
+    int i;
+    for (i = 1; i < NUM_INODES; i++) {
+	assert(balloc_inode() == i);
+	init_inode(i, UFS_REGULAR_FILE);
+    }
+    assert(balloc_inode() == -1);
+    bfree_inode(70);
+    bfree_inode(33);
+    assert(balloc_inode() == 33);
+    assert(balloc_inode() == 70);
+    assert(balloc_inode() == -1);
+
+    // two files growing at once: the one that finds its next block taken
+    // moves to an empty 64-block group instead of alternating with the other
+    inode_t *a = bcache_inode(1), *b = bcache_inode(2);
+    assert(balloc_file_block(1, 0) == data + 1);
+    assert(balloc_file_block(2, 0) == data + 2);
+    for (i = 1; i < FILE_BLOCKS; i++) {
+	assert(balloc_file_block(1, i) != -1);
+	assert(balloc_file_block(2, i) != -1);
+    }
+    a->size = b->size = FILE_BLOCKS * UFS_BLOCK_SIZE;
+    assert(a->direct[1] == data + 64);
+    assert(a->direct[FILE_BLOCKS - 1] == data + 64 + FILE_BLOCKS - 2);
+    for (i = 1; i < FILE_BLOCKS; i++)
+	assert(b->direct[i] == b->direct[i - 1] + 1);
+    balloc_report(stdout);
+
+    // freed blocks go back to first fit
+    for (i = 0; i < FILE_BLOCKS; i++)
+	bfree_block(b->direct[i]);
+    assert(balloc_block(-1) == data + 2);
+
+    // fill the region up; the partial last word must not hand out
+    // blocks past the end
+    int got = 1 + FILE_BLOCKS + 1; // root, a, and the block just above
+    int block;
+    while ((block = balloc_block(-1)) != -1) {
+	assert(block >= data && block < data + NUM_DATA);
+	got++;
+    }
+    assert(got == NUM_DATA);
+    assert(balloc_free_blocks() == 0);
+
+    // a goal that is taken falls back to whatever is free
+    bfree_block(data + NUM_DATA - 1);
+    assert(balloc_block(data + 5) == data + NUM_DATA - 1);
+    assert(balloc_block(-1) == -1);
+
+    printf("test_balloc: ok\n");
+    close(fd);
+    return 0;
+}
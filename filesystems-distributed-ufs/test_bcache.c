@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ufs.h"
+#include "bcache.h"
+
+// usage: test_bcache <image made by mkfs>
+//
+// Uses fewer cache slots than the file it writes, so dirty blocks are
+// evicted (written back early) and later reads miss and read ahead.
+
+#define SLOTS (16)
+#define FILE_BLOCKS (20)
+
+int main(int argc, char *argv[]) {
+    assert(argc == 2);
+    int fd = open(argv[1], O_RDWR);
+    assert(fd >= 0);
+    assert(bcache_init(fd, SLOTS) == 0);
+    super_t *s = bcache_super();
+
+    // the root directory, as mkfs made it
+    inode_t *root = bcache_inode(0);
+    assert(root->type == UFS_DIRECTORY);
+    assert(root->size == 2 * sizeof(dir_ent_t));
+    assert(root->direct[0] == s->data_region_addr);
+    dir_ent_t *ents = bcache_get(root->direct[0]);
+    assert(ents != NULL);
+    assert(strcmp(ents[0].name, ".") == 0 && ents[0].inum == 0);
+    assert(strcmp(ents[1].name, "..") == 0 && ents[1].inum == 0);
+    assert(ents[2].inum == -1);
+
+    // write a file (inode 1) and commit it
+    int i;
+    inode_t *file = bcache_inode(1);
+    file->type = UFS_REGULAR_FILE;
+    file->size = FILE_BLOCKS * UFS_BLOCK_SIZE;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	file->direct[i] = i < FILE_BLOCKS ? s->data_region_addr + 1 + i : -1;
+    bcache_dirty(bcache_inode_block(1));
+    for (i = 0; i < FILE_BLOCKS; i++) {
+	char *block = bcache_get_new(file->direct[i]);
+	assert(block != NULL);
+	memset(block, 'a' + i, UFS_BLOCK_SIZE);
+    }
+    assert(bcache_commit() == 0);
+
+    bcache_stats_t stats;
+    bcache_stats(&stats);
+    assert(stats.commits == 1);
+    assert(stats.writebacks >= FILE_BLOCKS);
+
+    // it is all on disk
+    char buf[UFS_BLOCK_SIZE];
+    for (i = 0; i < FILE_BLOCKS; i++) {
+	off_t offset = (off_t) file->direct[i] * UFS_BLOCK_SIZE;
+	assert(pread(fd, buf, UFS_BLOCK_SIZE, offset) == UFS_BLOCK_SIZE);
+	assert(buf[0] == 'a' + i && buf[UFS_BLOCK_SIZE - 1] == 'a' + i);
+    }
+    off_t offset = (off_t) bcache_inode_block(1) * UFS_BLOCK_SIZE;
+    assert(pread(fd, buf, UFS_BLOCK_SIZE, offset) == UFS_BLOCK_SIZE);
+    inode_t *on_disk = (inode_t *) buf + 1; // second inode of the block
+    assert(on_disk->type == UFS_REGULAR_FILE);
+    assert(on_disk->size == FILE_BLOCKS * UFS_BLOCK_SIZE);
+
+    // read it back in order: the early blocks were evicted, and reading
+    // sequentially brings the following ones in ahead of time
+    for (i = 0; i < FILE_BLOCKS; i++) {
+	char *block = bcache_get_file_block(1, i);
+	assert(block != NULL);
+	assert(block[0] == 'a' + i && block[UFS_BLOCK_SIZE - 1] == 'a' + i);
+    }
+    bcache_stats(&stats);
+    assert(stats.readahead > 0);
+
+    printf("test_bcache: ok (hits %lu, misses %lu, readahead %lu, "
+	   "writebacks %lu, commits %lu)\n", stats.hits, stats.misses,
+	   stats.readahead, stats.writebacks, stats.commits);
+    close(fd);
+
+    // over a read-only descriptor every write-back fails: once all slots
+    // are dirty, getting another block fails instead of spinning
+    fd = open(argv[1], O_RDONLY);
+    assert(fd >= 0);
+    assert(bcache_init(fd, SLOTS) == 0);
+    s = bcache_super();
+    int saved_stderr = dup(2);          // the expected pwrite() failures
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(saved_stderr >= 0 && null_fd >= 0);
+    dup2(null_fd, 2);
+    int filled = 0;
+    for (i = 0; i < SLOTS; i++)
+	filled += bcache_get_new(s->data_region_addr + 1 + i) != NULL;
+    void *new_block = bcache_get_new(s->data_region_addr + 1 + SLOTS);
+    void *old_block = bcache_get(s->data_region_addr + 1 + SLOTS);
+    void *file_block = bcache_get_file_block(1, SLOTS);
+    void *cached = bcache_get(s->data_region_addr + 1);
+    dup2(saved_stderr, 2);
+    assert(filled == SLOTS);
+    assert(new_block == NULL && old_block == NULL && file_block == NULL);
+    assert(cached != NULL); // still there, dirty
+    printf("test_bcache: full cache of unwritable blocks ok\n");
+    close(fd);
+    return 0;
+}
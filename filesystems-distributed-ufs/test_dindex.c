@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "ufs.h"
+#include "bcache.h"
+#include "dindex.h"
+
+// usage: test_dindex <image made by mkfs>
+//
+// Fills the root directory across two blocks, removes every other entry,
+// and checks the index against itself and against a rebuild from disk.
+
+#define ENTRIES (2 * DIR_ENTS_PER_BLOCK - 2) // fills both blocks
+
+static char *name_of(int i) {
+    static char name[28];
+    snprintf(name, sizeof(name), "f%d", i);
+    return name;
+}
+
+// entries i < n: every other one was removed if 'removed'
+static void check(int n, int removed) {
+    int i;
+    for (i = 0; i < n; i++) {
+	int expect = removed && i % 2 == 0 ? -1 : i + 1;
+	assert(dindex_lookup(0, name_of(i)) == expect);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    assert(argc == 2);
+    int fd = open(argv[1], O_RDWR);
+    assert(fd >= 0);
+    assert(bcache_init(fd, 64) == 0);
+    assert(dindex_init() == 0);
+
+    assert(dindex_lookup(0, ".") == 0 && dindex_lookup(0, "..") == 0);
+    assert(dindex_count(0) == 0);
+    assert(dindex_lookup(0, "missing") == -1);
+
+    // the first block takes 126 more entries, then the directory is full
+    int i;
+    for (i = 0; i < DIR_ENTS_PER_BLOCK - 2; i++)
+	assert(dindex_add(0, name_of(i), i + 1) == 0);
+    assert(dindex_add(0, name_of(i), i + 1) == -1);
+    inode_t *root = bcache_inode(0);
+    assert(root->size == DIR_ENTS_PER_BLOCK * sizeof(dir_ent_t));
+
+    // give it a second block (any unused data block will do here)
+    root->direct[1] = bcache_super()->data_region_addr + 5;
+    bcache_dirty(bcache_inode_block(0));
+    assert(dindex_add_block(0, 1) == 0);
+    for (; i < ENTRIES; i++)
+	assert(dindex_add(0, name_of(i), i + 1) == 0);
+    assert(dindex_add(0, "one too many", 999) == -1);
+    assert(dindex_count(0) == ENTRIES);
+
+    // a name already there is refused, even with a slot free
+    assert(dindex_remove(0, name_of(1)) == 2);
+    assert(dindex_add(0, name_of(3), 77) == -1);
+    assert(dindex_lookup(0, name_of(3)) == 4);
+    assert(dindex_add(0, name_of(1), 2) == 0);
+    assert(dindex_count(0) == ENTRIES);
+    check(ENTRIES, 0);
+
+    // remove every other entry; the size only shrinks with the last one
+    for (i = 0; i < ENTRIES; i += 2)
+	assert(dindex_remove(0, name_of(i)) == i + 1);
+    assert(dindex_remove(0, name_of(0)) == -1);
+    check(ENTRIES, 1);
+    assert(dindex_count(0) == ENTRIES / 2);
+    assert(root->size == 2 * DIR_ENTS_PER_BLOCK * sizeof(dir_ent_t));
+    assert(dindex_remove(0, name_of(ENTRIES - 1)) == ENTRIES);
+    // the last entry left is f251, in slot 253
+    assert(root->size == ENTRIES * sizeof(dir_ent_t));
+
+    // freed slots are reused
+    assert(dindex_add(0, "again", 500) == 0);
+    assert(dindex_lookup(0, "again") == 500);
+    assert(dindex_remove(0, "again") == 500);
+
+    // the same answers from an index rebuilt from the committed image
+    assert(bcache_commit() == 0);
+    dindex_drop(0);
+    check(ENTRIES - 1, 1);
+    assert(dindex_count(0) == ENTRIES / 2 - 1);
+
+    printf("test_dindex: ok\n");
+    close(fd);
+    return 0;
+}